@@ -0,0 +1,1095 @@
+// Benchmark suite: rb_tree and rb_map against std::set and std::map,
+// along with the linked, pooled and compact variants of the set, and the
+// bulk operations of rb_tree.
+//
+// In the ops suite, every combination of container, key type (int,
+// uint64, std::string), key pattern and size runs these workloads, in
+// this order, on one container per repetition:
+//
+//     insert         n keys into an empty container
+//     contains_hit   lookups of present keys
+//     contains_miss  lookups of absent keys
+//     iteration      a full scan
+//     range          lower_bound and the next 100 elements
+//     erase          all n keys again, emptying the container
+//
+// The keys are the even numbers 0, 2, ..., 2n - 2 (strings of them,
+// zero-padded so they sort the same way); misses are the odd numbers.
+// The pattern is the order of operations: sequential is ascending,
+// random a uniform shuffle, and zipfian draws lookups and range starts
+// from a Zipf distribution (s = 0.99) with the hot keys scattered over
+// the key space; its inserts and erases run in shuffled order, since a
+// set holds every key once.
+//
+// The other suites time single operations on int keys:
+//
+//     bulk      building rb_tree from n ascending keys with an insert
+//               loop, with insert(first, last) and with sorted_tag;
+//               --batch random keys inserted and erased one by one and
+//               with insert_batch/erase_batch; clear() of plain and
+//               pooled trees
+//     parallel  building a tree from n keys in random order, and union,
+//               intersection and difference of two such trees sharing
+//               half their keys, on a work_stealing_pool of each thread
+//               count; insert_loop is the sequential baseline
+//     mixed     each thread count of readers looking up present keys
+//               while one more thread inserts and erases absent ones,
+//               in concurrent_rb_tree and in an rb_tree behind a
+//               reader-writer lock
+//     writers   each thread count of writers sharing --lookups updates,
+//               three inserts of absent keys to one erase of a present
+//               key, in sharded_rb_tree (64 shards) and in the locked
+//               rb_tree
+//     lookup    contains_hit and contains_miss alone, in random order, on
+//               rb_tree, frozen_set and frozen_set with prefetching,
+//               each built from n sorted keys
+//     simd      the same lookups, one by one and with contains_batch
+//               over chunks of 1024 keys, on blocked_frozen_set limited
+//               to each instruction set the CPU has: avx2, sse42 and
+//               scalar
+//     batched   lookups of keys of which half are present, in an rb_tree
+//               built in random order: contains one key at a time
+//               against contains_batch and find_batch over chunks of
+//               1024 keys
+//
+// Operations are timed in chunks of 1024, or as a whole when one call
+// does all the work. The report has, per workload, the mean and
+// percentiles of ns per operation (per element, for a whole call) over
+// all chunks of the measured repetitions; warmup repetitions are run but
+// dropped. Rows also give the number of threads, 1 unless a suite sweeps
+// it. Everything is seeded, so runs are reproducible.
+//
+//     benchmark [--suite NAME] [--min-size N] [--max-size N]
+//               [--max-lookup-size N] [--repetitions N] [--warmup N]
+//               [--lookups N] [--batch N] [--threads N] [--seed N]
+//               [--filter TEXT] [--format csv|json]
+//
+// Sizes go from min-size to max-size in powers of ten (defaults 1000
+// and 10^6; 10^8 needs several GB). Read-only suites go on to
+// max-lookup-size, 10^8 by default, so that the keys outgrow the last
+// level cache by far; the rb_tree of 10^8 ints takes about 5 GB, and
+// the frozen sets take 400 MB. Thread sweeps double from 1 to
+// --threads, the hardware concurrency by default. --suite runs only the
+// named suite; --filter keeps the runs whose "container/key/pattern"
+// contains TEXT.
+
+#include "rb_tree.hpp"
+#include "rb_map.hpp"
+#include "pool_allocator.hpp"
+#include "compact_rb_tree.hpp"
+#include "work_stealing_pool.hpp"
+#include "concurrent_rb_tree.hpp"
+#include "sharded_rb_tree.hpp"
+#include "frozen_set.hpp"
+#include "blocked_frozen_set.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <set>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+struct options {
+    std::size_t min_size = 1000;
+    std::size_t max_size = 1000000;
+    std::size_t max_lookup_size = 100000000;
+    unsigned repetitions = 5;
+    unsigned warmup = 1;
+    std::size_t lookups = 1000000;
+    std::size_t batch = 10000;
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    std::uint64_t seed = 42;
+    std::string suite;
+    std::string filter;
+    bool json = false;
+
+    bool selects(const char * name) const {
+        return suite.empty() || suite == name;
+    }
+
+    bool keeps(const std::string & run) const {
+        return run.find(filter) != std::string::npos;
+    }
+};
+
+// Keeps results alive so the compiler cannot drop the work.
+volatile std::uint64_t sink;
+
+template <typename Key>
+Key make_key(std::size_t i);
+
+template <>
+int make_key<int>(std::size_t i) {
+    return static_cast<int>(i);
+}
+
+template <>
+std::uint64_t make_key<std::uint64_t>(std::size_t i) {
+    return i;
+}
+
+template <>
+std::string make_key<std::string>(std::size_t i) {
+    auto digits = std::to_string(i);
+    return "key:" + std::string(12 - digits.size(), '0') + digits;
+}
+
+template <typename Key>
+const char * key_name();
+
+template <>
+const char * key_name<int>() { return "int"; }
+
+template <>
+const char * key_name<std::uint64_t>() { return "uint64"; }
+
+template <>
+const char * key_name<std::string>() { return "string"; }
+
+std::uint64_t checksum(int value) {
+    return static_cast<std::uint64_t>(value);
+}
+
+std::uint64_t checksum(std::uint64_t value) {
+    return value;
+}
+
+std::uint64_t checksum(const std::string & value) {
+    return value.size();
+}
+
+template <typename Key, typename Mapped>
+std::uint64_t checksum(const std::pair<const Key, Mapped> & value) {
+    return checksum(value.first);
+}
+
+// The same operations on every container.
+template <typename Key>
+struct rb_set_target {
+    using container = rb_tree<Key>;
+    static const char * name() { return "rb_tree"; }
+    static void insert(container & c, const Key & k) { c.insert(k); }
+    static bool contains(const container & c, const Key & k) {
+        return c.contains(k);
+    }
+    static const container & values(const container & c) { return c; }
+    static auto from(const container & c, const Key & k) {
+        return c.lower_bound(k);
+    }
+};
+
+template <typename Key>
+struct linked_set_target {
+    using container = linked_rb_tree<Key>;
+    static const char * name() { return "linked_rb_tree"; }
+    static void insert(container & c, const Key & k) { c.insert(k); }
+    static bool contains(const container & c, const Key & k) {
+        return c.contains(k);
+    }
+    static const container & values(const container & c) { return c; }
+    static auto from(const container & c, const Key & k) {
+        return c.lower_bound(k);
+    }
+};
+
+template <typename Key>
+struct pooled_set_target {
+    using container = rb_tree<Key, std::less<Key>, pool_allocator<Key>>;
+    static const char * name() { return "pooled_rb_tree"; }
+    static void insert(container & c, const Key & k) { c.insert(k); }
+    static bool contains(const container & c, const Key & k) {
+        return c.contains(k);
+    }
+    static const container & values(const container & c) { return c; }
+    static auto from(const container & c, const Key & k) {
+        return c.lower_bound(k);
+    }
+};
+
+// Range starts are present keys, which find() reaches as well as a
+// lower_bound would.
+template <typename Key>
+struct compact_set_target {
+    using container = compact_rb_tree<Key>;
+    static const char * name() { return "compact_rb_tree"; }
+    static void insert(container & c, const Key & k) { c.insert(k); }
+    static bool contains(const container & c, const Key & k) {
+        return c.contains(k);
+    }
+    static const container & values(const container & c) { return c; }
+    static auto from(const container & c, const Key & k) {
+        return c.find(k);
+    }
+};
+
+template <typename Key>
+struct std_set_target {
+    using container = std::set<Key>;
+    static const char * name() { return "std::set"; }
+    static void insert(container & c, const Key & k) { c.insert(k); }
+    static bool contains(const container & c, const Key & k) {
+        return c.find(k) != c.end();
+    }
+    static const container & values(const container & c) { return c; }
+    static auto from(const container & c, const Key & k) {
+        return c.lower_bound(k);
+    }
+};
+
+template <typename Key>
+struct rb_map_target {
+    using container = rb_map<Key, std::uint64_t>;
+    static const char * name() { return "rb_map"; }
+    static void insert(container & c, const Key & k) { c.emplace(k, 0); }
+    static bool contains(const container & c, const Key & k) {
+        return c.contains(k);
+    }
+    static const container & values(const container & c) { return c; }
+    static auto from(const container & c, const Key & k) {
+        return c.lower_bound(k);
+    }
+};
+
+template <typename Key>
+struct std_map_target {
+    using container = std::map<Key, std::uint64_t>;
+    static const char * name() { return "std::map"; }
+    static void insert(container & c, const Key & k) { c.emplace(k, 0); }
+    static bool contains(const container & c, const Key & k) {
+        return c.find(k) != c.end();
+    }
+    static const container & values(const container & c) { return c; }
+    static auto from(const container & c, const Key & k) {
+        return c.lower_bound(k);
+    }
+};
+
+// Zipf-distributed ranks in [0, n), skew theta < 1, in O(1) per draw
+// after an O(n) setup (Gray et al., "Quickly generating billion-record
+// synthetic databases").
+class zipf_distribution {
+    std::size_t n;
+    double theta;
+    double zeta_n;
+    double alpha;
+    double eta;
+
+    static double zeta(std::size_t n, double theta) {
+        double sum = 0;
+        for (std::size_t i = 1; i <= n; ++i) {
+            sum += 1 / std::pow(static_cast<double>(i), theta);
+        }
+        return sum;
+    }
+
+public:
+
+    zipf_distribution(std::size_t n, double theta)
+            : n(n)
+            , theta(theta)
+            , zeta_n(zeta(n, theta))
+            , alpha(1 / (1 - theta))
+            , eta((1 - std::pow(2.0 / static_cast<double>(n), 1 - theta)) /
+                  (1 - zeta(2, theta) / zeta_n)) { }
+
+    template <typename Generator>
+    std::size_t operator()(Generator & generator) {
+        auto u = std::uniform_real_distribution<double>()(generator);
+        auto uz = u * zeta_n;
+        if (uz < 1) return 0;
+        if (uz < 1 + std::pow(0.5, theta)) return 1;
+        auto rank = static_cast<std::size_t>(
+            static_cast<double>(n) * std::pow(eta * u - eta + 1, alpha));
+        return std::min(rank, n - 1);
+    }
+};
+
+enum class pattern { sequential, random, zipfian };
+
+const char * pattern_name(pattern p) {
+    switch (p) {
+    case pattern::sequential: return "sequential";
+    case pattern::random: return "random";
+    default: return "zipfian";
+    }
+}
+
+// Indices (into the n keys) of the updates and of the lookups.
+struct operation_order {
+    std::vector<std::size_t> updates;
+    std::vector<std::size_t> lookups;
+};
+
+operation_order make_order(pattern p, std::size_t n, std::size_t lookups,
+                           std::mt19937_64 & generator) {
+    operation_order order;
+    order.updates.resize(n);
+    for (std::size_t i = 0; i < n; ++i) order.updates[i] = i;
+    if (p != pattern::sequential) {
+        std::shuffle(order.updates.begin(), order.updates.end(), generator);
+    }
+    order.lookups.resize(lookups);
+    if (p == pattern::zipfian) {
+        zipf_distribution zipf(n, 0.99);
+        // rank r is key updates[r]: the hottest keys are spread out
+        for (auto & i : order.lookups) i = order.updates[zipf(generator)];
+    } else if (p == pattern::random) {
+        std::uniform_int_distribution<std::size_t> uniform(0, n - 1);
+        for (auto & i : order.lookups) i = uniform(generator);
+    } else {
+        for (std::size_t j = 0; j < lookups; ++j) order.lookups[j] = j % n;
+    }
+    return order;
+}
+
+// ns per operation of every timed chunk of one workload.
+class samples {
+    std::vector<double> values;
+
+public:
+
+    void add(double ns_per_op) {
+        values.push_back(ns_per_op);
+    }
+
+    void add(const samples & other) {
+        values.insert(values.end(), other.values.begin(),
+                      other.values.end());
+    }
+
+    double mean() const {
+        double sum = 0;
+        for (auto value : values) sum += value;
+        return values.empty() ? 0 : sum / static_cast<double>(values.size());
+    }
+
+    // Nearest-rank percentile, p in [0, 100].
+    double percentile(double p) {
+        if (values.empty()) return 0;
+        std::sort(values.begin(), values.end());
+        auto rank = static_cast<std::size_t>(
+            std::ceil(p / 100 * static_cast<double>(values.size())));
+        return values[rank == 0 ? 0 : rank - 1];
+    }
+};
+
+// Runs f(j) for every j in [0, count), timing chunks of 1024 calls.
+template <typename F>
+void timed_calls(std::size_t count, samples * out, F f) {
+    using namespace std::chrono;
+    const std::size_t chunk = 1024;
+    for (std::size_t first = 0; first < count; first += chunk) {
+        auto last = std::min(first + chunk, count);
+        auto start = steady_clock::now();
+        for (auto j = first; j < last; ++j) f(j);
+        auto elapsed = duration<double, std::nano>(
+            steady_clock::now() - start).count();
+        if (out) out->add(elapsed / static_cast<double>(last - first));
+    }
+}
+
+// Runs f(i) for every index, timing chunks of 1024 calls.
+template <typename F>
+void timed(const std::vector<std::size_t> & indices, samples * out, F f) {
+    timed_calls(indices.size(), out, [&](std::size_t j) { f(indices[j]); });
+}
+
+// Times one call of f that handles ops elements, as a single chunk.
+template <typename F>
+void timed_once(std::size_t ops, samples * out, F f) {
+    using namespace std::chrono;
+    auto start = steady_clock::now();
+    f();
+    auto elapsed = duration<double, std::nano>(
+        steady_clock::now() - start).count();
+    if (out) out->add(elapsed / static_cast<double>(ops));
+}
+
+const char * const workloads[] = { "insert", "contains_hit", "contains_miss",
+                                   "iteration", "range", "erase" };
+
+const std::size_t workload_count = sizeof(workloads) / sizeof(*workloads);
+
+class report {
+    bool json;
+    bool first = true;
+
+public:
+
+    explicit report(bool json)
+            : json(json) {
+        if (json) {
+            std::cout << "[" << std::endl;
+        } else {
+            std::cout << "container,key,pattern,workload,size,threads,ops,"
+                         "mean_ns,p50_ns,p90_ns,p99_ns" << std::endl;
+        }
+    }
+
+    ~report() {
+        if (json) std::cout << std::endl << "]" << std::endl;
+    }
+
+    void add(const char * container, const char * key, const char * p,
+             const char * workload, std::size_t size, unsigned threads,
+             std::size_t ops, samples & s) {
+        auto mean = s.mean();
+        auto p50 = s.percentile(50);
+        auto p90 = s.percentile(90);
+        auto p99 = s.percentile(99);
+        if (json) {
+            std::cout << (first ? "" : ",\n") << "  {\"container\": \""
+                      << container << "\", \"key\": \"" << key
+                      << "\", \"pattern\": \"" << p << "\", \"workload\": \""
+                      << workload << "\", \"size\": " << size
+                      << ", \"threads\": " << threads << ", \"ops\": "
+                      << ops << ", \"mean_ns\": " << mean
+                      << ", \"p50_ns\": " << p50 << ", \"p90_ns\": " << p90
+                      << ", \"p99_ns\": " << p99 << "}";
+        } else {
+            std::cout << container << "," << key << "," << p << ","
+                      << workload << "," << size << "," << threads << ","
+                      << ops << "," << mean << "," << p50 << "," << p90
+                      << "," << p99 << std::endl;
+        }
+        first = false;
+    }
+};
+
+template <typename Target, typename Key>
+void run(const options & opts, pattern p, std::size_t n, report & out) {
+    auto name = std::string(Target::name()) + "/" + key_name<Key>() + "/" +
+                pattern_name(p);
+    if (!opts.keeps(name)) return;
+    std::mt19937_64 generator(opts.seed);
+    std::vector<Key> keys(n), misses(n);
+    for (std::size_t i = 0; i < n; ++i) {
+        keys[i] = make_key<Key>(2 * i);
+        misses[i] = make_key<Key>(2 * i + 1);
+    }
+    auto order = make_order(p, n, opts.lookups, generator);
+    std::vector<std::size_t> ranges(order.lookups.begin(),
+                                    order.lookups.begin() +
+                                    std::min<std::size_t>(
+                                        order.lookups.size(), 10000));
+    std::vector<std::size_t> scan(1, 0);
+    samples results[workload_count];
+    std::uint64_t sum = 0;
+    for (unsigned r = 0; r < opts.warmup + opts.repetitions; ++r) {
+        auto s = r < opts.warmup ? nullptr : results;
+        typename Target::container c;
+        timed(order.updates, s ? &s[0] : nullptr, [&](std::size_t i) {
+            Target::insert(c, keys[i]);
+        });
+        timed(order.lookups, s ? &s[1] : nullptr, [&](std::size_t i) {
+            sum += Target::contains(c, keys[i]);
+        });
+        timed(order.lookups, s ? &s[2] : nullptr, [&](std::size_t i) {
+            sum += Target::contains(c, misses[i]);
+        });
+        timed_once(n, s ? &s[3] : nullptr, [&] {
+            for (auto & value : Target::values(c)) sum += checksum(value);
+        });
+        timed(ranges, s ? &s[4] : nullptr, [&](std::size_t i) {
+            auto it = Target::from(c, keys[i]);
+            auto end = Target::values(c).end();
+            for (int j = 0; j < 100 && it != end; ++j, ++it) {
+                sum += checksum(*it);
+            }
+        });
+        timed(order.updates, s ? &s[5] : nullptr, [&](std::size_t i) {
+            c.erase(keys[i]);
+        });
+    }
+    sink = sum;
+    std::size_t ops[workload_count] = {
+        n, order.lookups.size(), order.lookups.size(), n, ranges.size(), n
+    };
+    for (std::size_t w = 0; w < workload_count; ++w) {
+        out.add(Target::name(), key_name<Key>(), pattern_name(p),
+                workloads[w], n, 1, ops[w], results[w]);
+    }
+}
+
+template <typename Key>
+void run_key(const options & opts, pattern p, std::size_t n, report & out) {
+    run<rb_set_target<Key>, Key>(opts, p, n, out);
+    run<linked_set_target<Key>, Key>(opts, p, n, out);
+    run<pooled_set_target<Key>, Key>(opts, p, n, out);
+    run<compact_set_target<Key>, Key>(opts, p, n, out);
+    run<std_set_target<Key>, Key>(opts, p, n, out);
+    run<rb_map_target<Key>, Key>(opts, p, n, out);
+    run<std_map_target<Key>, Key>(opts, p, n, out);
+}
+
+// The keys 2i + odd for i in [0, n): the ops suite's keys, or its misses.
+std::vector<int> int_keys(std::size_t n, std::size_t odd) {
+    std::vector<int> keys(n);
+    for (std::size_t i = 0; i < n; ++i) keys[i] = make_key<int>(2 * i + odd);
+    return keys;
+}
+
+void run_build(const options & opts, std::size_t n, report & out) {
+    if (!opts.keeps("rb_tree/int/sequential")) return;
+    auto keys = int_keys(n, 0);
+    const char * const names[] = { "insert_loop", "build_hinted",
+                                   "build_sorted" };
+    samples results[3];
+    std::uint64_t sum = 0;
+    for (unsigned r = 0; r < opts.warmup + opts.repetitions; ++r) {
+        auto s = r < opts.warmup ? nullptr : results;
+        rb_tree<int> loop, hinted, sorted;
+        timed_once(n, s ? &s[0] : nullptr, [&] {
+            for (auto k : keys) loop.insert(k);
+        });
+        timed_once(n, s ? &s[1] : nullptr, [&] {
+            hinted = rb_tree<int>(keys.begin(), keys.end());
+        });
+        timed_once(n, s ? &s[2] : nullptr, [&] {
+            sorted = rb_tree<int>(keys.begin(), keys.end(), sorted_tag());
+        });
+        sum += loop.size() + hinted.size() + sorted.size();
+    }
+    sink = sum;
+    for (std::size_t w = 0; w < 3; ++w) {
+        out.add("rb_tree", "int", "sequential", names[w], n, 1, n,
+                results[w]);
+    }
+}
+
+// --batch absent keys, in random order, into a tree of n keys and out
+// again: one at a time, then as one batch.
+void run_batch(const options & opts, std::size_t n, report & out) {
+    if (!opts.keeps("rb_tree/int/random")) return;
+    std::mt19937_64 generator(opts.seed);
+    auto keys = int_keys(n, 0);
+    auto batch = int_keys(n, 1);
+    std::shuffle(keys.begin(), keys.end(), generator);
+    std::shuffle(batch.begin(), batch.end(), generator);
+    batch.resize(std::min(opts.batch, n));
+    auto b = batch.size();
+    const char * const names[] = { "insert_each", "erase_each",
+                                   "insert_batch", "erase_batch" };
+    samples results[4];
+    std::uint64_t sum = 0;
+    for (unsigned r = 0; r < opts.warmup + opts.repetitions; ++r) {
+        auto s = r < opts.warmup ? nullptr : results;
+        rb_tree<int> tree(keys.begin(), keys.end());
+        timed_once(b, s ? &s[0] : nullptr, [&] {
+            for (auto k : batch) tree.insert(k);
+        });
+        timed_once(b, s ? &s[1] : nullptr, [&] {
+            for (auto k : batch) sum += tree.erase(k);
+        });
+        timed_once(b, s ? &s[2] : nullptr, [&] {
+            sum += tree.insert_batch(batch.begin(), batch.end()).size();
+        });
+        timed_once(b, s ? &s[3] : nullptr, [&] {
+            sum += tree.erase_batch(batch.begin(), batch.end()).size();
+        });
+    }
+    sink = sum;
+    for (std::size_t w = 0; w < 4; ++w) {
+        out.add("rb_tree", "int", "random", names[w], n, 1, b, results[w]);
+    }
+}
+
+// clear() of a tree built in random order, so that neighbours in the
+// tree are not neighbours in memory.
+template <typename Tree>
+void run_clear(const options & opts, const char * name, std::size_t n,
+               report & out) {
+    if (!opts.keeps(std::string(name) + "/int/random")) return;
+    std::mt19937_64 generator(opts.seed);
+    auto keys = int_keys(n, 0);
+    std::shuffle(keys.begin(), keys.end(), generator);
+    samples results;
+    for (unsigned r = 0; r < opts.warmup + opts.repetitions; ++r) {
+        Tree tree;
+        for (auto k : keys) tree.insert(k);
+        timed_once(n, r < opts.warmup ? nullptr : &results, [&] {
+            tree.clear();
+        });
+    }
+    out.add(name, "int", "random", "clear", n, 1, n, results);
+}
+
+void run_bulk(const options & opts, std::size_t n, report & out) {
+    using pooled = rb_tree<int, std::less<int>, pool_allocator<int>>;
+    run_build(opts, n, out);
+    run_batch(opts, n, out);
+    run_clear<rb_tree<int>>(opts, "rb_tree", n, out);
+    run_clear<pooled>(opts, "pooled_rb_tree", n, out);
+}
+
+// 1, 2, 4, ... and finally --threads itself.
+std::vector<unsigned> thread_counts(const options & opts) {
+    std::vector<unsigned> counts;
+    for (unsigned t = 1; t < opts.threads; t *= 2) counts.push_back(t);
+    counts.push_back(opts.threads);
+    return counts;
+}
+
+// Set operations are reported per element of both inputs.
+void run_parallel(const options & opts, std::size_t n, report & out) {
+    if (!opts.keeps("rb_tree/int/random")) return;
+    std::mt19937_64 generator(opts.seed);
+    std::vector<int> a(n), b(n);
+    for (std::size_t i = 0; i < n; ++i) {
+        a[i] = make_key<int>(i);
+        b[i] = make_key<int>(i + n / 2);
+    }
+    std::shuffle(a.begin(), a.end(), generator);
+    std::shuffle(b.begin(), b.end(), generator);
+    std::uint64_t sum = 0;
+    samples loop;
+    for (unsigned r = 0; r < opts.warmup + opts.repetitions; ++r) {
+        rb_tree<int> tree;
+        timed_once(n, r < opts.warmup ? nullptr : &loop, [&] {
+            for (auto k : a) tree.insert(k);
+        });
+        sum += tree.size();
+    }
+    out.add("rb_tree", "int", "random", "insert_loop", n, 1, n, loop);
+    const char * const names[] = { "parallel_build", "parallel_union",
+                                   "parallel_intersection",
+                                   "parallel_difference" };
+    for (auto threads : thread_counts(opts)) {
+        work_stealing_pool pool(threads);
+        samples results[4];
+        auto set_operation = [&](samples * s, auto op) {
+            rb_tree<int> lhs(a.begin(), a.end(), pool);
+            rb_tree<int> rhs(b.begin(), b.end(), pool);
+            timed_once(2 * n, s, [&] { op(lhs, std::move(rhs)); });
+            sum += lhs.size();
+        };
+        for (unsigned r = 0; r < opts.warmup + opts.repetitions; ++r) {
+            auto s = r < opts.warmup ? nullptr : results;
+            rb_tree<int> tree;
+            timed_once(n, s ? &s[0] : nullptr, [&] {
+                tree = rb_tree<int>(a.begin(), a.end(), pool);
+            });
+            sum += tree.size();
+            set_operation(s ? &s[1] : nullptr,
+                          [&](rb_tree<int> & lhs, rb_tree<int> && rhs) {
+                              lhs.set_union(std::move(rhs), pool);
+                          });
+            set_operation(s ? &s[2] : nullptr,
+                          [&](rb_tree<int> & lhs, rb_tree<int> && rhs) {
+                              lhs.set_intersection(std::move(rhs), pool);
+                          });
+            set_operation(s ? &s[3] : nullptr,
+                          [&](rb_tree<int> & lhs, rb_tree<int> && rhs) {
+                              lhs.set_difference(std::move(rhs), pool);
+                          });
+        }
+        out.add("rb_tree", "int", "random", names[0], n, threads, n,
+                results[0]);
+        for (std::size_t w = 1; w < 4; ++w) {
+            out.add("rb_tree", "int", "random", names[w], n, threads, 2 * n,
+                    results[w]);
+        }
+    }
+    sink = sum;
+}
+
+// The usual way to share an rb_tree between threads.
+class locked_rb_tree {
+    rb_tree<int> tree;
+    mutable std::shared_mutex mutex;
+
+public:
+
+    bool contains(int k) const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return tree.contains(k);
+    }
+
+    bool insert(int k) {
+        std::lock_guard<std::shared_mutex> lock(mutex);
+        return tree.insert(k).second;
+    }
+
+    bool erase(int k) {
+        std::lock_guard<std::shared_mutex> lock(mutex);
+        return tree.erase(k) != 0;
+    }
+};
+
+// Every reader makes --lookups lookups, starting at its own offset into
+// the order; the writer inserts all misses, then erases them, and so on
+// until the readers are done. Rows count the readers only.
+template <typename Set>
+void run_mixed(const options & opts, const char * name, std::size_t n,
+               report & out) {
+    if (!opts.keeps(std::string(name) + "/int/random")) return;
+    std::mt19937_64 generator(opts.seed);
+    auto keys = int_keys(n, 0);
+    auto misses = int_keys(n, 1);
+    std::shuffle(keys.begin(), keys.end(), generator);
+    std::shuffle(misses.begin(), misses.end(), generator);
+    auto lookups = make_order(pattern::random, n, opts.lookups,
+                              generator).lookups;
+    std::atomic<std::uint64_t> sum{ 0 };
+    for (auto readers : thread_counts(opts)) {
+        samples reads, writes;
+        std::size_t written = 0;
+        for (unsigned r = 0; r < opts.warmup + opts.repetitions; ++r) {
+            bool measured = r >= opts.warmup;
+            Set set;
+            for (auto k : keys) set.insert(k);
+            std::vector<samples> local(readers);
+            std::atomic<unsigned> running{ readers };
+            std::vector<std::thread> threads;
+            for (unsigned t = 0; t < readers; ++t) {
+                threads.emplace_back([&, t] {
+                    std::uint64_t found = 0;
+                    auto offset = t * lookups.size() / readers;
+                    auto s = measured ? &local[t] : nullptr;
+                    timed_calls(lookups.size(), s, [&](std::size_t j) {
+                        auto i = lookups[(j + offset) % lookups.size()];
+                        found += set.contains(keys[i]);
+                    });
+                    sum += found;
+                    --running;
+                });
+            }
+            std::size_t j = 0;
+            while (running.load() != 0) {
+                timed_calls(1024, measured ? &writes : nullptr,
+                            [&](std::size_t) {
+                    auto k = misses[j % n];
+                    if (j++ / n % 2 == 0) {
+                        set.insert(k);
+                    } else {
+                        set.erase(k);
+                    }
+                });
+            }
+            for (auto & thread : threads) thread.join();
+            for (auto & l : local) reads.add(l);
+            if (measured) written += j;
+        }
+        out.add(name, "int", "random", "mixed_read", n, readers,
+                readers * lookups.size(), reads);
+        out.add(name, "int", "random", "mixed_write", n, readers,
+                written / opts.repetitions, writes);
+    }
+    sink = sum;
+}
+
+// Every writer starts at its own offset into one shuffled order of the
+// keys. Rows count updates per writer, and their total is the same for
+// every thread count.
+template <typename Set, typename Create>
+void run_writers(const options & opts, const char * name, std::size_t n,
+                 report & out, Create create) {
+    if (!opts.keeps(std::string(name) + "/int/random")) return;
+    std::mt19937_64 generator(opts.seed);
+    auto keys = int_keys(n, 0);
+    auto misses = int_keys(n, 1);
+    auto order = make_order(pattern::random, n, 0, generator).updates;
+    for (auto writers : thread_counts(opts)) {
+        auto updates = opts.lookups / writers;
+        samples results;
+        for (unsigned r = 0; r < opts.warmup + opts.repetitions; ++r) {
+            bool measured = r >= opts.warmup;
+            std::unique_ptr<Set> set = create(keys);
+            std::vector<samples> local(writers);
+            std::vector<std::thread> threads;
+            for (unsigned t = 0; t < writers; ++t) {
+                threads.emplace_back([&, t] {
+                    auto offset = t * n / writers;
+                    auto s = measured ? &local[t] : nullptr;
+                    timed_calls(updates, s, [&](std::size_t j) {
+                        auto i = order[(j + offset) % n];
+                        if (j % 4 != 3) {
+                            set->insert(misses[i]);
+                        } else {
+                            set->erase(keys[i]);
+                        }
+                    });
+                });
+            }
+            for (auto & thread : threads) thread.join();
+            for (auto & l : local) results.add(l);
+        }
+        out.add(name, "int", "random", "update", n, writers, updates,
+                results);
+    }
+}
+
+// Set is built once per size from the sorted keys.
+template <typename Set>
+void run_lookups(const options & opts, const char * name, std::size_t n,
+                 report & out) {
+    if (!opts.keeps(std::string(name) + "/int/random")) return;
+    std::mt19937_64 generator(opts.seed);
+    auto keys = int_keys(n, 0);
+    auto misses = int_keys(n, 1);
+    auto lookups = make_order(pattern::random, n, opts.lookups,
+                              generator).lookups;
+    Set set(keys.begin(), keys.end(), sorted_tag());
+    samples results[2];
+    std::uint64_t sum = 0;
+    for (unsigned r = 0; r < opts.warmup + opts.repetitions; ++r) {
+        auto s = r < opts.warmup ? nullptr : results;
+        timed(lookups, s ? &s[0] : nullptr, [&](std::size_t i) {
+            sum += set.contains(keys[i]);
+        });
+        timed(lookups, s ? &s[1] : nullptr, [&](std::size_t i) {
+            sum += set.contains(misses[i]);
+        });
+    }
+    sink = sum;
+    out.add(name, "int", "random", "contains_hit", n, 1, lookups.size(),
+            results[0]);
+    out.add(name, "int", "random", "contains_miss", n, 1, lookups.size(),
+            results[1]);
+}
+
+const char * simd_name(simd_level level) {
+    switch (level) {
+    case simd_level::avx2: return "blocked_frozen_set_avx2";
+    case simd_level::sse42: return "blocked_frozen_set_sse42";
+    default: return "blocked_frozen_set_scalar";
+    }
+}
+
+// limit_simd only lowers the level, so the levels go from the fastest
+// down; those the CPU lacks are skipped.
+void run_simd(const options & opts, std::size_t n, report & out) {
+    const simd_level levels[] = { simd_level::avx2, simd_level::sse42,
+                                  simd_level::scalar };
+    if (std::none_of(std::begin(levels), std::end(levels),
+                     [&](simd_level level) {
+                         return opts.keeps(std::string(simd_name(level)) +
+                                           "/int/random");
+                     })) {
+        return;
+    }
+    std::mt19937_64 generator(opts.seed);
+    auto keys = int_keys(n, 0);
+    blocked_frozen_set<int> set(keys.begin(), keys.end(), sorted_tag());
+    std::vector<int> hits, misses;
+    for (auto i : make_order(pattern::random, n, opts.lookups,
+                             generator).lookups) {
+        hits.push_back(keys[i]);
+        misses.push_back(make_key<int>(2 * i + 1));
+    }
+    keys = std::vector<int>();
+    const char * const names[] = { "contains_hit", "contains_miss",
+                                   "contains_batch_hit",
+                                   "contains_batch_miss" };
+    std::uint64_t sum = 0;
+    auto batches = [&](const std::vector<int> & queries, samples * s) {
+        const std::size_t chunk = 1024;
+        bool found[chunk];
+        for (std::size_t first = 0; first < queries.size(); first += chunk) {
+            auto last = std::min(first + chunk, queries.size());
+            timed_once(last - first, s, [&] {
+                set.contains_batch(queries.begin() + first,
+                                   queries.begin() + last, found);
+            });
+            sum += std::count(found, found + (last - first), true);
+        }
+    };
+    for (auto level : levels) {
+        set.limit_simd(level);
+        auto name = simd_name(level);
+        if (set.simd() != level ||
+            !opts.keeps(std::string(name) + "/int/random")) {
+            continue;
+        }
+        samples results[4];
+        for (unsigned r = 0; r < opts.warmup + opts.repetitions; ++r) {
+            auto s = r < opts.warmup ? nullptr : results;
+            timed_calls(hits.size(), s ? &s[0] : nullptr,
+                        [&](std::size_t j) {
+                sum += set.contains(hits[j]);
+            });
+            timed_calls(misses.size(), s ? &s[1] : nullptr,
+                        [&](std::size_t j) {
+                sum += set.contains(misses[j]);
+            });
+            batches(hits, s ? &s[2] : nullptr);
+            batches(misses, s ? &s[3] : nullptr);
+        }
+        for (std::size_t w = 0; w < 4; ++w) {
+            out.add(name, "int", "random", names[w], n, 1, hits.size(),
+                    results[w]);
+        }
+    }
+    sink = sum;
+}
+
+// The tree is built in random order, so that neighbours in the tree
+// are not neighbours in memory, as in a tree that has lived a while.
+void run_batched(const options & opts, std::size_t n, report & out) {
+    if (!opts.keeps("rb_tree/int/random")) return;
+    std::mt19937_64 generator(opts.seed);
+    auto keys = int_keys(n, 0);
+    std::shuffle(keys.begin(), keys.end(), generator);
+    rb_tree<int> tree;
+    for (auto k : keys) tree.insert(k);
+    keys = std::vector<int>();
+    std::vector<int> queries(opts.lookups);
+    std::uniform_int_distribution<std::size_t> uniform(0, 2 * n - 1);
+    for (auto & k : queries) k = make_key<int>(uniform(generator));
+    const char * const names[] = { "contains_loop", "contains_batch",
+                                   "find_batch" };
+    samples results[3];
+    std::uint64_t sum = 0;
+    const std::size_t chunk = 1024;
+    bool found[chunk];
+    rb_tree<int>::const_iterator positions[chunk];
+    for (unsigned r = 0; r < opts.warmup + opts.repetitions; ++r) {
+        auto s = r < opts.warmup ? nullptr : results;
+        timed_calls(queries.size(), s ? &s[0] : nullptr,
+                    [&](std::size_t j) {
+            sum += tree.contains(queries[j]);
+        });
+        for (std::size_t first = 0; first < queries.size(); first += chunk) {
+            auto last = std::min(first + chunk, queries.size());
+            timed_once(last - first, s ? &s[1] : nullptr, [&] {
+                tree.contains_batch(queries.begin() + first,
+                                    queries.begin() + last, found);
+            });
+            sum += std::count(found, found + (last - first), true);
+            timed_once(last - first, s ? &s[2] : nullptr, [&] {
+                tree.find_batch(queries.begin() + first,
+                                queries.begin() + last, positions);
+            });
+            sum += std::count(positions, positions + (last - first),
+                              tree.end());
+        }
+    }
+    sink = sum;
+    for (std::size_t w = 0; w < 3; ++w) {
+        out.add("rb_tree", "int", "random", names[w], n, 1, queries.size(),
+                results[w]);
+    }
+}
+
+const char * const suites[] = { "ops", "bulk", "parallel", "mixed",
+                                "writers", "lookup", "simd", "batched" };
+
+bool parse(int argc, char ** argv, options & opts) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 == argc) return false;
+        std::string value = argv[++i];
+        if (arg == "--min-size") {
+            opts.min_size = std::stoull(value);
+        } else if (arg == "--max-size") {
+            opts.max_size = std::stoull(value);
+        } else if (arg == "--max-lookup-size") {
+            opts.max_lookup_size = std::stoull(value);
+        } else if (arg == "--repetitions") {
+            opts.repetitions = static_cast<unsigned>(std::stoul(value));
+        } else if (arg == "--warmup") {
+            opts.warmup = static_cast<unsigned>(std::stoul(value));
+        } else if (arg == "--lookups") {
+            opts.lookups = std::stoull(value);
+        } else if (arg == "--batch") {
+            opts.batch = std::stoull(value);
+        } else if (arg == "--threads") {
+            opts.threads = static_cast<unsigned>(std::stoul(value));
+        } else if (arg == "--suite" &&
+                   std::find(std::begin(suites), std::end(suites),
+                             value) != std::end(suites)) {
+            opts.suite = value;
+        } else if (arg == "--seed") {
+            opts.seed = std::stoull(value);
+        } else if (arg == "--filter") {
+            opts.filter = value;
+        } else if (arg == "--format" && (value == "csv" || value == "json")) {
+            opts.json = value == "json";
+        } else {
+            return false;
+        }
+    }
+    return opts.min_size > 0 && opts.lookups > 0 && opts.batch > 0 &&
+           opts.threads > 0;
+}
+
+}
+
+int main(int argc, char ** argv) {
+    options opts;
+    try {
+        if (!parse(argc, argv, opts)) {
+            std::cerr << "usage: " << argv[0] << " [--suite NAME]"
+                      << " [--min-size N] [--max-size N]"
+                      << " [--max-lookup-size N]"
+                      << " [--repetitions N] [--warmup N] [--lookups N]"
+                      << " [--batch N] [--threads N] [--seed N]"
+                      << " [--filter TEXT] [--format csv|json]"
+                      << std::endl << "suites:";
+            for (auto suite : suites) std::cerr << " " << suite;
+            std::cerr << std::endl;
+            return 2;
+        }
+    } catch (const std::exception &) {
+        std::cerr << argv[0] << ": numbers expected" << std::endl;
+        return 2;
+    }
+    report out(opts.json);
+    for (auto n = opts.min_size; n <= opts.max_size; n *= 10) {
+        if (opts.selects("ops")) {
+            for (auto p : { pattern::sequential, pattern::random,
+                            pattern::zipfian }) {
+                run_key<int>(opts, p, n, out);
+                run_key<std::uint64_t>(opts, p, n, out);
+                run_key<std::string>(opts, p, n, out);
+            }
+        }
+        if (opts.selects("bulk")) run_bulk(opts, n, out);
+        if (opts.selects("parallel")) run_parallel(opts, n, out);
+        if (opts.selects("mixed")) {
+            run_mixed<concurrent_rb_tree<int>>(opts, "concurrent_rb_tree",
+                                               n, out);
+            run_mixed<locked_rb_tree>(opts, "locked_rb_tree", n, out);
+        }
+        if (opts.selects("writers")) {
+            run_writers<sharded_rb_tree<int>>(opts, "sharded_rb_tree", n,
+                                              out, [](auto & keys) {
+                auto set = std::make_unique<sharded_rb_tree<int>>(
+                    keys.begin(), keys.end(), 64);
+                for (auto k : keys) set->insert(k);
+                return set;
+            });
+            run_writers<locked_rb_tree>(opts, "locked_rb_tree", n, out,
+                                        [](auto & keys) {
+                auto set = std::make_unique<locked_rb_tree>();
+                for (auto k : keys) set->insert(k);
+                return set;
+            });
+        }
+    }
+    for (auto n = opts.min_size; n <= opts.max_lookup_size; n *= 10) {
+        if (opts.selects("lookup")) {
+            run_lookups<rb_tree<int>>(opts, "rb_tree", n, out);
+            run_lookups<frozen_set<int, std::less<int>, false>>(
+                opts, "frozen_set", n, out);
+            run_lookups<frozen_set<int>>(opts, "frozen_set_prefetch", n,
+                                         out);
+        }
+        if (opts.selects("simd")) run_simd(opts, n, out);
+        if (opts.selects("batched")) run_batched(opts, n, out);
+    }
+    return 0;
+}
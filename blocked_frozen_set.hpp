@@ -0,0 +1,332 @@
+#ifndef BLOCKED_FROZEN_SET_HPP
+#define BLOCKED_FROZEN_SET_HPP
+
+#include "frozen_set.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <type_traits>
+#include <vector>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define BLOCKED_FROZEN_SET_X86 1
+#include <immintrin.h>
+#endif
+
+// Instruction sets blocked_frozen_set can compare keys with.
+enum class simd_level { scalar, sse42, avx2 };
+
+// Best level the CPU supports, from CPUID.
+inline simd_level detect_simd_level() {
+#ifdef BLOCKED_FROZEN_SET_X86
+    static const simd_level level =
+        __builtin_cpu_supports("avx2") ? simd_level::avx2 :
+        __builtin_cpu_supports("sse4.2") ? simd_level::sse42 :
+        simd_level::scalar;
+    return level;
+#else
+    return simd_level::scalar;
+#endif
+}
+
+// Read-only set of 32- or 64-bit integers laid out as an implicit B-tree:
+// blocks of one cache line (16 or 8 keys) with the children of block k at
+// k * (B + 1) + 1 ... k * (B + 1) + B + 1. A lookup reads one line per
+// level, log_17(n) of them for 32-bit keys against log_2(n) in a
+// frozen_set, and ranks the key within a block by comparing it with all
+// keys of the block at once: with AVX2 or SSE4.2 when the CPU has them,
+// chosen at run time, or with plain comparisons otherwise. The tail of
+// the last blocks is padded with the largest key.
+template <typename Key>
+class blocked_frozen_set {
+    static_assert(std::is_integral<Key>::value &&
+                  (sizeof(Key) == 4 || sizeof(Key) == 8),
+                  "keys must be 32- or 64-bit integers");
+
+    // Unsigned keys are stored with the sign bit flipped, so that signed
+    // comparisons, the only ones SSE and AVX2 have, order them right.
+    using stored = std::conditional_t<sizeof(Key) == 4,
+                                      std::int32_t, std::int64_t>;
+    using unsigned_stored = std::make_unsigned_t<stored>;
+
+    static constexpr std::size_t block_keys = 64 / sizeof(Key);
+    static constexpr stored padding = std::numeric_limits<stored>::max();
+
+    std::vector<stored, cache_aligned_allocator<stored>> keys;
+    std::size_t blocks;
+    std::size_t count;
+    bool has_padding_key;   // whether padding is also a real key
+    simd_level level;
+
+    static stored to_stored(Key k) {
+        if constexpr (std::is_signed<Key>::value) {
+            return static_cast<stored>(k);
+        }
+        return static_cast<stored>(
+            static_cast<unsigned_stored>(k) ^
+            (unsigned_stored(1) << (sizeof(Key) * 8 - 1)));
+    }
+
+    static std::size_t child(std::size_t k, std::size_t i) {
+        return k * (block_keys + 1) + i + 1;
+    }
+
+    // Assigns the next values of it to the blocks below k in key order.
+    template <typename It, typename Value>
+    void fill(It & it, Value & value, std::size_t & taken, std::size_t k) {
+        if (k >= blocks) return;
+        for (std::size_t i = 0; i < block_keys; ++i) {
+            fill(it, value, taken, child(k, i));
+            if (taken < count) {
+                auto x = to_stored(value(*it));
+                keys[k * block_keys + i] = x;
+                has_padding_key |= x == padding;
+                ++it;
+                ++taken;
+            } else {
+                keys[k * block_keys + i] = padding;
+            }
+        }
+        fill(it, value, taken, child(k, block_keys));
+    }
+
+    template <typename It, typename Value>
+    void build(It first, std::size_t size, Value value) {
+        count = size;
+        blocks = (size + block_keys - 1) / block_keys;
+        keys.resize(blocks * block_keys);
+        std::size_t taken = 0;
+        fill(first, value, taken, 0);
+    }
+
+    template <typename Tree>
+    friend blocked_frozen_set<typename Tree::value_type>
+    freeze_blocked(const Tree & tree);
+
+    // Number of keys in the block that are less than x.
+    static unsigned rank_scalar(const stored * block, stored x) {
+        unsigned rank = 0;
+        for (std::size_t i = 0; i < block_keys; ++i) rank += block[i] < x;
+        return rank;
+    }
+
+    // Each finds x by descending one block per level, remembering the
+    // first key not less than x seen so far.
+    static bool find_scalar(const stored * keys, std::size_t blocks,
+                            stored x) {
+        stored result = padding;
+        for (std::size_t k = 0; k < blocks;) {
+            auto i = rank_scalar(keys + k * block_keys, x);
+            if (i < block_keys) result = keys[k * block_keys + i];
+            k = child(k, i);
+        }
+        return result == x;
+    }
+
+#ifdef BLOCKED_FROZEN_SET_X86
+    __attribute__((target("sse4.2,popcnt")))
+    static unsigned rank_sse42(const stored * block, stored x) {
+        unsigned mask = 0;
+        if constexpr (sizeof(stored) == 4) {
+            auto key = _mm_set1_epi32(static_cast<int>(x));
+            for (int i = 0; i < 4; ++i) {
+                auto keys = _mm_load_si128(
+                    reinterpret_cast<const __m128i *>(block) + i);
+                mask |= static_cast<unsigned>(_mm_movemask_ps(
+                    _mm_castsi128_ps(_mm_cmpgt_epi32(key, keys)))) << 4 * i;
+            }
+        } else {
+            auto key = _mm_set1_epi64x(static_cast<long long>(x));
+            for (int i = 0; i < 4; ++i) {
+                auto keys = _mm_load_si128(
+                    reinterpret_cast<const __m128i *>(block) + i);
+                mask |= static_cast<unsigned>(_mm_movemask_pd(
+                    _mm_castsi128_pd(_mm_cmpgt_epi64(key, keys)))) << 2 * i;
+            }
+        }
+        return static_cast<unsigned>(__builtin_popcount(mask));
+    }
+
+    __attribute__((target("sse4.2,popcnt")))
+    static bool find_sse42(const stored * keys, std::size_t blocks,
+                           stored x) {
+        stored result = padding;
+        for (std::size_t k = 0; k < blocks;) {
+            auto i = rank_sse42(keys + k * block_keys, x);
+            if (i < block_keys) result = keys[k * block_keys + i];
+            k = child(k, i);
+        }
+        return result == x;
+    }
+
+    __attribute__((target("avx2,popcnt")))
+    static unsigned rank_avx2(const stored * block, stored x) {
+        unsigned mask = 0;
+        if constexpr (sizeof(stored) == 4) {
+            auto key = _mm256_set1_epi32(static_cast<int>(x));
+            for (int i = 0; i < 2; ++i) {
+                auto keys = _mm256_load_si256(
+                    reinterpret_cast<const __m256i *>(block) + i);
+                mask |= static_cast<unsigned>(_mm256_movemask_ps(
+                    _mm256_castsi256_ps(_mm256_cmpgt_epi32(key, keys))))
+                    << 8 * i;
+            }
+        } else {
+            auto key = _mm256_set1_epi64x(static_cast<long long>(x));
+            for (int i = 0; i < 2; ++i) {
+                auto keys = _mm256_load_si256(
+                    reinterpret_cast<const __m256i *>(block) + i);
+                mask |= static_cast<unsigned>(_mm256_movemask_pd(
+                    _mm256_castsi256_pd(_mm256_cmpgt_epi64(key, keys))))
+                    << 4 * i;
+            }
+        }
+        return static_cast<unsigned>(__builtin_popcount(mask));
+    }
+
+    __attribute__((target("avx2,popcnt")))
+    static bool find_avx2(const stored * keys, std::size_t blocks,
+                          stored x) {
+        stored result = padding;
+        for (std::size_t k = 0; k < blocks;) {
+            auto i = rank_avx2(keys + k * block_keys, x);
+            if (i < block_keys) result = keys[k * block_keys + i];
+            k = child(k, i);
+        }
+        return result == x;
+    }
+
+    // The batch loops are compiled for their instruction set as a whole,
+    // so that the block ranking inlines into them.
+    __attribute__((target("sse4.2,popcnt")))
+    static void find_all_sse42(const stored * keys, std::size_t blocks,
+                               const stored * x, std::size_t n,
+                               bool * found) {
+        for (std::size_t j = 0; j < n; ++j) {
+            found[j] = find_sse42(keys, blocks, x[j]);
+        }
+    }
+
+    __attribute__((target("avx2,popcnt")))
+    static void find_all_avx2(const stored * keys, std::size_t blocks,
+                              const stored * x, std::size_t n,
+                              bool * found) {
+        for (std::size_t j = 0; j < n; ++j) {
+            found[j] = find_avx2(keys, blocks, x[j]);
+        }
+    }
+#endif
+
+    static void find_all_scalar(const stored * keys, std::size_t blocks,
+                                const stored * x, std::size_t n,
+                                bool * found) {
+        for (std::size_t j = 0; j < n; ++j) {
+            found[j] = find_scalar(keys, blocks, x[j]);
+        }
+    }
+
+    void find_all(const stored * x, std::size_t n, bool * found) const {
+#ifdef BLOCKED_FROZEN_SET_X86
+        if (level == simd_level::avx2) {
+            return find_all_avx2(keys.data(), blocks, x, n, found);
+        }
+        if (level == simd_level::sse42) {
+            return find_all_sse42(keys.data(), blocks, x, n, found);
+        }
+#endif
+        find_all_scalar(keys.data(), blocks, x, n, found);
+    }
+
+public:
+
+    blocked_frozen_set()
+            : blocks(0)
+            , count(0)
+            , has_padding_key(false)
+            , level(detect_simd_level()) { }
+
+    // [first, last) must be sorted ascending.
+    template <typename ForwardIt>
+    blocked_frozen_set(ForwardIt first, ForwardIt last, sorted_tag)
+            : blocked_frozen_set() {
+        build(first, static_cast<std::size_t>(std::distance(first, last)),
+              [](Key k) { return k; });
+    }
+
+    bool contains(Key k) const {
+        auto x = to_stored(k);
+        if (x == padding) return has_padding_key;
+#ifdef BLOCKED_FROZEN_SET_X86
+        if (level == simd_level::avx2) {
+            return find_avx2(keys.data(), blocks, x);
+        }
+        if (level == simd_level::sse42) {
+            return find_sse42(keys.data(), blocks, x);
+        }
+#endif
+        return find_scalar(keys.data(), blocks, x);
+    }
+
+    // Writes contains(k) for every k of [first, last) to out, dispatching
+    // on the instruction set once per group of keys rather than per key.
+    template <typename InputIt, typename OutputIt>
+    OutputIt contains_batch(InputIt first, InputIt last, OutputIt out) const {
+        constexpr std::size_t group = 256;
+        stored x[group];
+        bool found[group];
+        while (first != last) {
+            std::size_t n = 0;
+            bool padded[group];
+            for (; n < group && first != last; ++n, ++first) {
+                x[n] = to_stored(*first);
+                padded[n] = x[n] == padding;
+            }
+            find_all(x, n, found);
+            for (std::size_t j = 0; j < n; ++j) {
+                *out++ = padded[j] ? has_padding_key : found[j];
+            }
+        }
+        return out;
+    }
+
+    std::size_t size() const {
+        return count;
+    }
+
+    bool empty() const {
+        return count == 0;
+    }
+
+    simd_level simd() const {
+        return level;
+    }
+
+    // Uses at most the given instruction set, e.g. for comparisons. The
+    // level never exceeds what the CPU supports.
+    void limit_simd(simd_level limit) {
+        level = static_cast<int>(limit) < static_cast<int>(level)
+                    ? limit : level;
+    }
+
+};
+
+// Copies the keys of a set of integers ordered by std::less into a
+// blocked_frozen_set in O(n).
+template <typename Tree>
+blocked_frozen_set<typename Tree::value_type>
+freeze_blocked(const Tree & tree) {
+    using value_type = typename Tree::value_type;
+    static_assert(std::is_same<typename Tree::key_type, value_type>::value &&
+                  std::is_same<typename Tree::key_compare,
+                               std::less<value_type>>::value,
+                  "only sets ordered by std::less can be frozen in blocks");
+    blocked_frozen_set<value_type> result;
+    result.build(tree.begin(), tree.size(),
+                 [](const value_type & value) { return value; });
+    return result;
+}
+
+#endif
@@ -0,0 +1,572 @@
+#ifndef COMPACT_RB_TREE_HPP
+#define COMPACT_RB_TREE_HPP
+
+#include "rb_tree.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+// Node linked by 32-bit indices into the pool of its tree, with the color
+// in the lowest bit of the parent index: 12 bytes of links, so a node of
+// int takes 16 bytes where node_with_value<int> takes 32. value is only
+// alive while the node is in the tree.
+template <typename T>
+struct compact_node {
+    std::uint32_t left;
+    std::uint32_t right;
+    std::uint32_t parent_color;   // parent << 1 | color
+    union {
+        T value;
+    };
+
+    compact_node() : left(0), right(0), parent_color(0) { }
+
+    ~compact_node() { }
+};
+
+// Set of T with the insert, find, erase and iteration semantics of
+// rb_tree, built from compact_node. Nodes live in chunks of chunk_size and
+// are addressed by index; index 0 is the tree's leaf sentinel. Chunks are
+// never moved, so pointers to values and iterators stay valid until their
+// node is erased, and freed nodes are reused before new ones are taken.
+// A tree holds at most 2^31 - 1 values.
+template <typename T,
+          typename Compare = std::less<T>,
+          typename Allocator = std::allocator<T>>
+class compact_rb_tree : private ebo_storage<Compare, 0> {
+    using node = compact_node<T>;
+    using index = std::uint32_t;
+    using node_allocator = typename std::allocator_traits<Allocator>::
+        template rebind_alloc<node>;
+    using node_alloc_traits = std::allocator_traits<node_allocator>;
+    using compare_holder = ebo_storage<Compare, 0>;
+
+    static constexpr index nil = 0;
+    static constexpr unsigned chunk_bits = 10;
+    static constexpr std::size_t chunk_size = std::size_t(1) << chunk_bits;
+    static constexpr std::size_t max_nodes = (std::size_t(1) << 31) - 1;
+
+    std::vector<node *> chunks;
+    index root;
+    index free_list;   // chained through left
+    std::size_t used;  // slots handed out so far, including nil
+    std::size_t node_count;
+    node_allocator alloc;
+
+    const Compare & comp() const {
+        return compare_holder::get();
+    }
+
+    node & at(index i) const {
+        return chunks[i >> chunk_bits][i & (chunk_size - 1)];
+    }
+
+    index left(index i) const { return at(i).left; }
+
+    index right(index i) const { return at(i).right; }
+
+    index parent(index i) const { return at(i).parent_color >> 1; }
+
+    node_color color(index i) const {
+        return static_cast<node_color>(at(i).parent_color & 1);
+    }
+
+    void set_parent(index i, index p) {
+        at(i).parent_color = p << 1 | (at(i).parent_color & 1);
+    }
+
+    void set_color(index i, node_color c) {
+        at(i).parent_color = (at(i).parent_color & ~index(1)) | c;
+    }
+
+    index minimum(index x) const {
+        if (x == nil) return nil;
+        while (left(x) != nil) x = left(x);
+        return x;
+    }
+
+    index maximum(index x) const {
+        if (x == nil) return nil;
+        while (right(x) != nil) x = right(x);
+        return x;
+    }
+
+    // The first chunk also holds nil in slot 0.
+    void add_chunk() {
+        // room first, so push_back cannot throw and leak the chunk
+        if (chunks.size() == chunks.capacity()) {
+            chunks.reserve(2 * chunks.size() + 1);
+        }
+        auto chunk = node_alloc_traits::allocate(alloc, chunk_size);
+        for (std::size_t i = 0; i < chunk_size; ++i) {
+            ::new (static_cast<void *>(chunk + i)) node();
+        }
+        chunks.push_back(chunk);
+        if (used == 0) used = 1;
+    }
+
+    // Takes a free slot, reusing freed ones first.
+    index allocate_slot() {
+        if (free_list != nil) {
+            auto i = free_list;
+            free_list = left(i);
+            return i;
+        }
+        if (used == chunks.size() * chunk_size) {
+            if (used >= max_nodes) {
+                throw std::length_error("compact_rb_tree is full");
+            }
+            add_chunk();
+        }
+        return static_cast<index>(used++);
+    }
+
+    template <typename... Args>
+    index create_node(index parent, Args &&... args) {
+        auto z = allocate_slot();
+        try {
+            node_alloc_traits::construct(alloc, &at(z).value,
+                                         std::forward<Args>(args)...);
+        } catch (...) {
+            at(z).left = free_list;
+            free_list = z;
+            throw;
+        }
+        at(z).left = nil;
+        at(z).right = nil;
+        at(z).parent_color = parent << 1 | red;
+        return z;
+    }
+
+    void destroy_node(index z) {
+        node_alloc_traits::destroy(alloc, &at(z).value);
+        at(z).left = free_list;
+        free_list = z;
+    }
+
+    void left_rotate(index x) {
+        auto y = right(x);
+        at(x).right = left(y);
+        if (left(y) != nil) set_parent(left(y), x);
+        set_parent(y, parent(x));
+        if (parent(x) == nil) {
+            root = y;
+        } else if (x == left(parent(x))) {
+            at(parent(x)).left = y;
+        } else {
+            at(parent(x)).right = y;
+        }
+        at(y).left = x;
+        set_parent(x, y);
+    }
+
+    void right_rotate(index x) {
+        auto y = left(x);
+        at(x).left = right(y);
+        if (right(y) != nil) set_parent(right(y), x);
+        set_parent(y, parent(x));
+        if (parent(x) == nil) {
+            root = y;
+        } else if (x == right(parent(x))) {
+            at(parent(x)).right = y;
+        } else {
+            at(parent(x)).left = y;
+        }
+        at(y).right = x;
+        set_parent(x, y);
+    }
+
+    void fixup_insert(index z) {
+        while (color(parent(z)) == red) {
+            auto p = parent(z);
+            auto g = parent(p);
+            if (p == left(g)) {
+                auto y = right(g);
+                if (color(y) == red) {
+                    set_color(p, black);
+                    set_color(y, black);
+                    set_color(g, red);
+                    z = g;
+                } else {
+                    if (z == right(p)) {
+                        z = p;
+                        left_rotate(z);
+                    }
+                    set_color(parent(z), black);
+                    set_color(g, red);
+                    right_rotate(g);
+                }
+            } else {
+                auto y = left(g);
+                if (color(y) == red) {
+                    set_color(p, black);
+                    set_color(y, black);
+                    set_color(g, red);
+                    z = g;
+                } else {
+                    if (z == left(p)) {
+                        z = p;
+                        right_rotate(z);
+                    }
+                    set_color(parent(z), black);
+                    set_color(g, red);
+                    left_rotate(g);
+                }
+            }
+        }
+        set_color(root, black);
+    }
+
+    // Unlike node_base<T>::sentinel, nil belongs to this tree alone, so
+    // its parent may be set here as fixup_erase expects.
+    void transplant(index u, index v) {
+        if (parent(u) == nil) {
+            root = v;
+        } else if (u == left(parent(u))) {
+            at(parent(u)).left = v;
+        } else {
+            at(parent(u)).right = v;
+        }
+        set_parent(v, parent(u));
+    }
+
+    void fixup_erase(index x) {
+        while (x != root && color(x) == black) {
+            auto p = parent(x);
+            if (x == left(p)) {
+                auto w = right(p);
+                if (color(w) == red) {
+                    set_color(w, black);
+                    set_color(p, red);
+                    left_rotate(p);
+                    w = right(p);
+                }
+                if (color(left(w)) == black && color(right(w)) == black) {
+                    set_color(w, red);
+                    x = p;
+                } else {
+                    if (color(right(w)) == black) {
+                        set_color(left(w), black);
+                        set_color(w, red);
+                        right_rotate(w);
+                        w = right(p);
+                    }
+                    set_color(w, color(p));
+                    set_color(p, black);
+                    set_color(right(w), black);
+                    left_rotate(p);
+                    x = root;
+                }
+            } else {
+                auto w = left(p);
+                if (color(w) == red) {
+                    set_color(w, black);
+                    set_color(p, red);
+                    right_rotate(p);
+                    w = left(p);
+                }
+                if (color(right(w)) == black && color(left(w)) == black) {
+                    set_color(w, red);
+                    x = p;
+                } else {
+                    if (color(left(w)) == black) {
+                        set_color(right(w), black);
+                        set_color(w, red);
+                        left_rotate(w);
+                        w = left(p);
+                    }
+                    set_color(w, color(p));
+                    set_color(p, black);
+                    set_color(left(w), black);
+                    right_rotate(p);
+                    x = root;
+                }
+            }
+        }
+        set_color(x, black);
+    }
+
+    void erase_node(index z) {
+        auto y = z;
+        auto y_original_color = color(y);
+        index x;
+        if (left(z) == nil) {
+            x = right(z);
+            transplant(z, right(z));
+        } else if (right(z) == nil) {
+            x = left(z);
+            transplant(z, left(z));
+        } else {
+            y = minimum(right(z));
+            y_original_color = color(y);
+            x = right(y);
+            if (parent(y) == z) {
+                set_parent(x, y);
+            } else {
+                transplant(y, right(y));
+                at(y).right = right(z);
+                set_parent(right(y), y);
+            }
+            transplant(z, y);
+            at(y).left = left(z);
+            set_parent(left(y), y);
+            set_color(y, color(z));
+        }
+        if (y_original_color == black) fixup_erase(x);
+        destroy_node(z);
+        --node_count;
+    }
+
+    index find_node(const T & k) const {
+        auto x = root;
+        while (x != nil) {
+            if (comp()(k, at(x).value)) {
+                x = left(x);
+            } else if (comp()(at(x).value, k)) {
+                x = right(x);
+            } else {
+                break;
+            }
+        }
+        return x;
+    }
+
+    template <typename... Args>
+    index insert_node(const T & k, Args &&... args) {
+        auto y = nil;
+        auto x = root;
+        bool go_left = false;
+        while (x != nil) {
+            y = x;
+            go_left = comp()(k, at(x).value);
+            if (!go_left && !comp()(at(x).value, k)) return nil;
+            x = go_left ? left(x) : right(x);
+        }
+        auto z = create_node(y, std::forward<Args>(args)...);
+        if (y == nil) {
+            root = z;
+        } else if (go_left) {
+            at(y).left = z;
+        } else {
+            at(y).right = z;
+        }
+        ++node_count;
+        fixup_insert(z);
+        return z;
+    }
+
+    // Destroys every value in the subtree of x in O(n) time and constant
+    // space, like rb_tree's teardown: left children are rotated up until
+    // the node at hand has none. Scrambles the links, but never those of
+    // nil.
+    void destroy_values(index x) {
+        while (x != nil) {
+            if (left(x) != nil) {
+                auto y = left(x);
+                at(x).left = right(y);
+                at(y).right = x;
+                x = y;
+            } else {
+                auto next = right(x);
+                node_alloc_traits::destroy(alloc, &at(x).value);
+                x = next;
+            }
+        }
+    }
+
+public:
+
+    class const_iterator {
+        const compact_rb_tree * tree;
+        index i;
+
+        friend class compact_rb_tree;
+
+        const_iterator(const compact_rb_tree * tree, index i)
+                : tree(tree)
+                , i(i) { }
+
+    public:
+
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T *;
+        using reference = const T &;
+
+        const_iterator() : tree(nullptr), i(nil) { }
+
+        const_iterator & operator++() {
+            if (tree->right(i) != nil) {
+                i = tree->minimum(tree->right(i));
+                return *this;
+            }
+            auto p = tree->parent(i);
+            while (p != nil && i == tree->right(p)) {
+                i = p;
+                p = tree->parent(p);
+            }
+            i = p;
+            return *this;
+        }
+
+        const_iterator operator++(int) {
+            const_iterator it(*this);
+            ++(*this);
+            return it;
+        }
+
+        const_iterator & operator--() {
+            if (i == nil) {
+                i = tree->maximum(tree->root);
+                return *this;
+            }
+            if (tree->left(i) != nil) {
+                i = tree->maximum(tree->left(i));
+                return *this;
+            }
+            auto p = tree->parent(i);
+            while (p != nil && i == tree->left(p)) {
+                i = p;
+                p = tree->parent(p);
+            }
+            i = p;
+            return *this;
+        }
+
+        const_iterator operator--(int) {
+            const_iterator it(*this);
+            --(*this);
+            return it;
+        }
+
+        const T & operator*() const {
+            return tree->at(i).value;
+        }
+
+        const T * operator->() const {
+            return &tree->at(i).value;
+        }
+
+        friend bool operator==(const const_iterator & lhs,
+                               const const_iterator & rhs) {
+            return lhs.i == rhs.i;
+        }
+
+        friend bool operator!=(const const_iterator & lhs,
+                               const const_iterator & rhs) {
+            return lhs.i != rhs.i;
+        }
+    };
+
+    static constexpr std::size_t node_size = sizeof(node);
+
+    explicit compact_rb_tree(const Compare & comp = Compare(),
+                             const Allocator & alloc = Allocator())
+            : compare_holder(comp)
+            , root(nil)
+            , free_list(nil)
+            , used(0)
+            , node_count(0)
+            , alloc(alloc) { }
+
+    compact_rb_tree(const compact_rb_tree &) = delete;
+
+    compact_rb_tree & operator=(const compact_rb_tree &) = delete;
+
+    compact_rb_tree(compact_rb_tree && other) noexcept
+            : compare_holder(other.comp())
+            , chunks(std::move(other.chunks))
+            , root(other.root)
+            , free_list(other.free_list)
+            , used(other.used)
+            , node_count(other.node_count)
+            , alloc(std::move(other.alloc)) {
+        other.chunks.clear();
+        other.root = nil;
+        other.free_list = nil;
+        other.used = 0;
+        other.node_count = 0;
+    }
+
+    ~compact_rb_tree() {
+        clear();
+        for (auto chunk : chunks) {
+            node_alloc_traits::deallocate(alloc, chunk, chunk_size);
+        }
+    }
+
+    // Returns end() if an equal value is already present.
+    const_iterator insert(const T & value) {
+        return const_iterator(this, insert_node(value, value));
+    }
+
+    const_iterator insert(T && value) {
+        return const_iterator(this, insert_node(value, std::move(value)));
+    }
+
+    const_iterator find(const T & k) const {
+        return const_iterator(this, find_node(k));
+    }
+
+    bool contains(const T & k) const {
+        return find_node(k) != nil;
+    }
+
+    // Returns the iterator following pos.
+    const_iterator erase(const_iterator pos) {
+        auto next = std::next(pos);
+        erase_node(pos.i);
+        return next;
+    }
+
+    std::size_t erase(const T & k) {
+        auto z = find_node(k);
+        if (z == nil) return 0;
+        erase_node(z);
+        return 1;
+    }
+
+    // Destroys every value but keeps the chunks for reuse.
+    void clear() {
+        destroy_values(root);
+        root = nil;
+        free_list = nil;
+        used = chunks.empty() ? 0 : 1;
+        node_count = 0;
+    }
+
+    // Allocates chunks for n values up front.
+    void reserve(std::size_t n) {
+        if (n + 1 > max_nodes) {
+            throw std::length_error("compact_rb_tree is full");
+        }
+        while (chunks.size() * chunk_size < n + 1) add_chunk();
+    }
+
+    std::size_t size() const {
+        return node_count;
+    }
+
+    bool empty() const {
+        return node_count == 0;
+    }
+
+    const_iterator begin() const {
+        return const_iterator(this, minimum(root));
+    }
+
+    const_iterator end() const {
+        return const_iterator(this, nil);
+    }
+
+};
+
+#endif
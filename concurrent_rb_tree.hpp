@@ -0,0 +1,273 @@
+#ifndef CONCURRENT_RB_TREE_HPP
+#define CONCURRENT_RB_TREE_HPP
+
+#include "path_copying_tree.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Epoch-based reclamation for one writer and any number of readers.
+// Readers announce the epoch they entered in on a striped counter; the
+// writer may move the epoch from e to e + 1 once nobody is left in
+// e - 1. Whatever was unlinked during e - 1 is then unreachable for
+// every reader and can be freed.
+class epoch_domain {
+    static constexpr std::size_t stripes = 16;
+
+    struct alignas(64) counter {
+        std::atomic<std::size_t> value{ 0 };
+    };
+
+    std::atomic<std::uint64_t> epoch{ 0 };
+    mutable counter active[2][stripes];
+
+    static std::size_t stripe() {
+        static thread_local const std::size_t index =
+            std::hash<std::thread::id>()(std::this_thread::get_id()) %
+            stripes;
+        return index;
+    }
+
+public:
+
+    // Lock-free: retries only if the writer moved the epoch meanwhile.
+    std::uint64_t enter() const {
+        auto s = stripe();
+        while (true) {
+            auto e = epoch.load();
+            active[e & 1][s].value.fetch_add(1);
+            if (epoch.load() == e) return e;
+            active[e & 1][s].value.fetch_sub(1);
+        }
+    }
+
+    void leave(std::uint64_t e) const {
+        active[e & 1][stripe()].value.fetch_sub(1);
+    }
+
+    std::uint64_t current() const {
+        return epoch.load(std::memory_order_relaxed);
+    }
+
+    // Writer only. Returns whether the epoch advanced.
+    bool try_advance() {
+        auto e = epoch.load();
+        for (auto & c : active[(e + 1) & 1]) {
+            if (c.value.load() != 0) return false;
+        }
+        epoch.store(e + 1);
+        return true;
+    }
+
+};
+
+// Set whose lookups and iteration are lock-free and run concurrently with
+// one writer at a time. Writers never modify a published node: insert and
+// erase copy the O(log n) nodes they would touch, rebalance the copies
+// like fixup_insert/fixup_erase do, and publish the new root atomically.
+// Replaced nodes are retired and freed only when no reader can still be
+// looking at them. Concurrent writers are serialized by a mutex.
+template <typename T,
+          typename Compare = std::less<T>,
+          typename Allocator = std::allocator<T>>
+class concurrent_rb_tree
+        : private ebo_storage<Compare, 0>
+        , private path_copying_tree<
+                concurrent_rb_tree<T, Compare, Allocator>,
+                immutable_node<T>> {
+    using node = immutable_node<T>;
+    using node_allocator = typename std::allocator_traits<Allocator>::
+        template rebind_alloc<node>;
+    using node_alloc_traits = std::allocator_traits<node_allocator>;
+    using compare_holder = ebo_storage<Compare, 0>;
+    using core = path_copying_tree<concurrent_rb_tree, node>;
+    using update = typename core::update;
+
+    friend core;
+
+    std::atomic<node *> root;
+    std::atomic<std::size_t> node_count;
+    epoch_domain epochs;
+    std::mutex writer;
+    node_allocator alloc;
+    std::vector<node *> limbo[2];
+
+    const Compare & comp() const {
+        return compare_holder::get();
+    }
+
+    template <typename... Args>
+    node * create_node(Args &&... args) {
+        auto z = node_alloc_traits::allocate(alloc, 1);
+        try {
+            node_alloc_traits::construct(alloc, z,
+                                         std::forward<Args>(args)...);
+        } catch (...) {
+            node_alloc_traits::deallocate(alloc, z, 1);
+            throw;
+        }
+        return z;
+    }
+
+    void destroy_node(node * x) {
+        node_alloc_traits::destroy(alloc, x);
+        node_alloc_traits::deallocate(alloc, x, 1);
+    }
+
+    node * clone_node(node * x) {
+        return create_node(*x);
+    }
+
+    void abandon(update & u) {
+        for (auto x : u.created) destroy_node(x);
+    }
+
+    void free_nodes(node * x) {
+        while (x) {
+            free_nodes(x->link[0]);
+            auto next = x->link[1];
+            destroy_node(x);
+            x = next;
+        }
+    }
+
+    // Publishes u.top and retires the replaced nodes. The retired list of
+    // the previous epoch is freed once no reader can hold its nodes.
+    void publish(update & u) {
+        root.store(u.top, std::memory_order_release);
+        auto & retired = limbo[epochs.current() & 1];
+        retired.insert(retired.end(), u.retired.begin(), u.retired.end());
+        if (epochs.try_advance()) {
+            for (auto x : limbo[epochs.current() & 1]) destroy_node(x);
+            limbo[epochs.current() & 1].clear();
+        }
+    }
+
+    template <typename... Args>
+    bool insert_node(const T & k, Args &&... args) {
+        std::lock_guard<std::mutex> lock(writer);
+        update u;
+        auto top = root.load(std::memory_order_relaxed);
+        if (!this->insert_path(u, top, k, std::forward<Args>(args)...)) {
+            return false;
+        }
+        publish(u);
+        node_count.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    bool erase_node(const T & k) {
+        std::lock_guard<std::mutex> lock(writer);
+        update u;
+        if (!this->erase_path(u, root.load(std::memory_order_relaxed), k)) {
+            return false;
+        }
+        publish(u);
+        node_count.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+
+public:
+
+    // Pins the tree as it is now: lookups and iteration through the view
+    // see one version and never block, and no node it can reach is freed
+    // while it lives.
+    class view {
+        const concurrent_rb_tree * tree;
+        std::uint64_t epoch;
+        const node * top;
+
+        friend class concurrent_rb_tree;
+
+        explicit view(const concurrent_rb_tree & tree)
+                : tree(&tree)
+                , epoch(tree.epochs.enter())
+                , top(tree.root.load(std::memory_order_acquire)) { }
+
+    public:
+
+        view(const view &) = delete;
+
+        view & operator=(const view &) = delete;
+
+        ~view() {
+            tree->epochs.leave(epoch);
+        }
+
+        const T * find(const T & k) const {
+            auto x = core::find_node(top, k, tree->comp());
+            return x ? &x->value : nullptr;
+        }
+
+        bool contains(const T & k) const {
+            return find(k) != nullptr;
+        }
+
+        const immutable_node<T> * get_root() const {
+            return top;
+        }
+
+        immutable_tree_iterator<T> begin() const {
+            return immutable_tree_iterator<T>(top);
+        }
+
+        immutable_tree_iterator<T> end() const {
+            return immutable_tree_iterator<T>();
+        }
+    };
+
+    explicit concurrent_rb_tree(const Compare & comp = Compare(),
+                                const Allocator & alloc = Allocator())
+            : compare_holder(comp)
+            , root(nullptr)
+            , node_count(0)
+            , alloc(alloc) { }
+
+    concurrent_rb_tree(const concurrent_rb_tree &) = delete;
+
+    concurrent_rb_tree & operator=(const concurrent_rb_tree &) = delete;
+
+    // No view may outlive the tree.
+    ~concurrent_rb_tree() {
+        free_nodes(root.load(std::memory_order_relaxed));
+        for (auto & retired : limbo) {
+            for (auto x : retired) destroy_node(x);
+        }
+    }
+
+    view read() const {
+        return view(*this);
+    }
+
+    bool contains(const T & k) const {
+        return read().contains(k);
+    }
+
+    // Both return false, and change nothing, if k is already present
+    // (insert) or absent (erase).
+    bool insert(const T & value) {
+        return insert_node(value, value);
+    }
+
+    bool insert(T && value) {
+        return insert_node(value, std::move(value));
+    }
+
+    bool erase(const T & k) {
+        return erase_node(k);
+    }
+
+    std::size_t size() const {
+        return node_count.load(std::memory_order_relaxed);
+    }
+
+};
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef EXECUTOR_HPP
+#define EXECUTOR_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <limits>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Runs both branches of a fork on the calling thread. Algorithms that can
+// split their work take any executor with this interface:
+//
+//     void fork_join(F && f, G && g);   // runs f() and g(), possibly in
+//                                       // parallel, and returns when
+//                                       // both are done
+//     std::size_t grain_size() const;   // pieces of work at most this
+//                                       // big are not worth a fork
+//
+// work_stealing_pool is the parallel one.
+struct sequential_executor {
+    template <typename F, typename G>
+    void fork_join(F && f, G && g) {
+        f();
+        g();
+    }
+
+    std::size_t grain_size() const {
+        return std::numeric_limits<std::size_t>::max();
+    }
+};
+
+template <typename Executor, typename = void>
+struct is_executor : std::false_type { };
+
+template <typename Executor>
+struct is_executor<Executor,
+        decltype(void(std::declval<Executor &>().fork_join(
+                     std::declval<void (*)()>(),
+                     std::declval<void (*)()>())),
+                 void(std::declval<const Executor &>().grain_size()))>
+        : std::true_type { };
+
+// Calls f(begin, end) on consecutive pieces of [first, last), no larger
+// than the grain size, forking down to them.
+template <typename Executor, typename F>
+void parallel_for(Executor & executor, std::size_t first, std::size_t last,
+                  F & f) {
+    if (last - first <= executor.grain_size()) {
+        if (first != last) f(first, last);
+        return;
+    }
+    auto middle = first + (last - first) / 2;
+    executor.fork_join([&] { parallel_for(executor, first, middle, f); },
+                       [&] { parallel_for(executor, middle, last, f); });
+}
+
+// Stable merge of two sorted ranges into out. The larger range is cut at
+// its middle and the other one at the matching bound, so both halves can
+// be merged independently.
+template <typename Executor, typename It, typename Out, typename Compare>
+void parallel_merge(Executor & executor, It first1, It last1,
+                    It first2, It last2, Out out, Compare & comp) {
+    auto n1 = static_cast<std::size_t>(last1 - first1);
+    auto n2 = static_cast<std::size_t>(last2 - first2);
+    // cutting fewer than three elements might not make progress
+    if (n1 + n2 <= std::max<std::size_t>(executor.grain_size(), 2)) {
+        std::merge(std::make_move_iterator(first1),
+                   std::make_move_iterator(last1),
+                   std::make_move_iterator(first2),
+                   std::make_move_iterator(last2), out, comp);
+        return;
+    }
+    It cut1, cut2;
+    if (n1 >= n2) {
+        cut1 = first1 + n1 / 2;
+        cut2 = std::lower_bound(first2, last2, *cut1, comp);
+    } else {
+        cut2 = first2 + n2 / 2;
+        cut1 = std::upper_bound(first1, last1, *cut2, comp);
+    }
+    auto out2 = out + (cut1 - first1) + (cut2 - first2);
+    executor.fork_join(
+        [&] { parallel_merge(executor, first1, cut1, first2, cut2,
+                             out, comp); },
+        [&] { parallel_merge(executor, cut1, last1, cut2, last2,
+                             out2, comp); });
+}
+
+// Sorts [first, last) and leaves the result there, or in buffer when
+// into_buffer is set. Halves are sorted into the other array so that
+// every level merges straight into its destination.
+template <typename Executor, typename It, typename Buffer, typename Compare>
+void parallel_sort_into(Executor & executor, It first, It last,
+                        Buffer buffer, bool into_buffer, Compare & comp) {
+    auto n = static_cast<std::size_t>(last - first);
+    if (n <= std::max<std::size_t>(executor.grain_size(), 2)) {
+        std::stable_sort(first, last, comp);
+        if (into_buffer) std::move(first, last, buffer);
+        return;
+    }
+    auto middle = n / 2;
+    executor.fork_join(
+        [&] { parallel_sort_into(executor, first, first + middle,
+                                 buffer, !into_buffer, comp); },
+        [&] { parallel_sort_into(executor, first + middle, last,
+                                 buffer + middle, !into_buffer, comp); });
+    if (into_buffer) {
+        parallel_merge(executor, first, first + middle,
+                       first + middle, last, buffer, comp);
+    } else {
+        parallel_merge(executor, buffer, buffer + middle,
+                       buffer + middle, buffer + n, first, comp);
+    }
+}
+
+// Stable merge sort with parallel merges: O(n log n) work and
+// O(log^3 n) span. Needs n default-constructible elements of scratch.
+template <typename Executor, typename RandomIt, typename Compare>
+void parallel_stable_sort(Executor & executor, RandomIt first,
+                          RandomIt last, Compare comp) {
+    using value_type =
+        typename std::iterator_traits<RandomIt>::value_type;
+    std::vector<value_type> buffer(static_cast<std::size_t>(last - first));
+    parallel_sort_into(executor, first, last, buffer.begin(), false, comp);
+}
+
+#endif
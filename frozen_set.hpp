@@ -0,0 +1,257 @@
+#ifndef FROZEN_SET_HPP
+#define FROZEN_SET_HPP
+
+#include "rb_tree.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+// Allocator whose blocks start on a cache line.
+template <typename T>
+struct cache_aligned_allocator {
+    using value_type = T;
+
+    static constexpr std::size_t alignment = 64;
+
+    cache_aligned_allocator() = default;
+
+    template <typename U>
+    cache_aligned_allocator(const cache_aligned_allocator<U> &) { }
+
+    T * allocate(std::size_t n) {
+        return static_cast<T *>(::operator new(
+            n * sizeof(T), std::align_val_t(alignment)));
+    }
+
+    void deallocate(T * p, std::size_t) {
+        ::operator delete(p, std::align_val_t(alignment));
+    }
+
+    template <typename U>
+    bool operator==(const cache_aligned_allocator<U> &) const { return true; }
+
+    template <typename U>
+    bool operator!=(const cache_aligned_allocator<U> &) const { return false; }
+};
+
+// Read-only sorted set in one array, laid out in Eytzinger (BFS) order:
+// the root at index 1 and the children of k at 2k and 2k + 1. A search
+// descends with one comparison and no branch per level, and the 16
+// descendants four levels below k (for 4-byte keys) share one cache line,
+// so with Prefetch that line is requested long before it is needed and
+// the latency of a miss overlaps with the levels above it. Built from a
+// tree with freeze() in O(n) and turned back into one with thaw().
+//
+// T has to be default-constructible; slot 0 is unused.
+template <typename T, typename Compare = std::less<T>, bool Prefetch = true>
+class frozen_set : private ebo_storage<Compare, 0> {
+    using compare_holder = ebo_storage<Compare, 0>;
+
+    std::vector<T, cache_aligned_allocator<T>> keys;
+
+    // Number of keys per cache line, at least one.
+    static constexpr std::size_t line_keys =
+        sizeof(T) >= 64 ? 1 : 64 / sizeof(T);
+
+    const Compare & comp() const {
+        return compare_holder::get();
+    }
+
+    std::size_t n() const {
+        return keys.empty() ? 0 : keys.size() - 1;
+    }
+
+    template <bool P, typename Tree>
+    friend frozen_set<typename Tree::value_type, typename Tree::key_compare,
+                      P> freeze(const Tree & tree);
+
+    // Assigns value(*it) for the next values of it to the subtree of k
+    // in order.
+    template <typename It, typename Value>
+    void fill(It & it, Value & value, std::size_t k) {
+        if (k > n()) return;
+        fill(it, value, 2 * k);
+        keys[k] = value(*it);
+        ++it;
+        fill(it, value, 2 * k + 1);
+    }
+
+    template <typename It, typename Value>
+    frozen_set(It first, std::size_t size, Value value,
+               const Compare & comp)
+            : compare_holder(comp) {
+        if (size == 0) return;
+        keys.resize(size + 1);
+        fill(first, value, 1);
+    }
+
+    // Slot of the first key not less than k (or, with Upper, greater than
+    // k), 0 if there is none. Every descent takes the same number of
+    // steps, the height of the array, and picks the child arithmetically.
+    template <bool Upper, typename K>
+    std::size_t bound(const K & k) const {
+        auto base = keys.data();
+        std::size_t i = 1;
+        auto size = n();
+        while (i <= size) {
+#if defined(__GNUC__)
+            if (Prefetch) {
+                // may point past the end: prefetches never fault
+                __builtin_prefetch(reinterpret_cast<const void *>(
+                    reinterpret_cast<std::uintptr_t>(base) +
+                    i * line_keys * sizeof(T)));
+            }
+#endif
+            bool right = Upper ? !comp()(k, base[i]) : comp()(base[i], k);
+            i = 2 * i + right;
+        }
+        // undo the right turns after the last left one
+        return i >> (count_trailing_ones(i) + 1);
+    }
+
+    static unsigned count_trailing_ones(std::size_t i) {
+#if defined(__GNUC__)
+        return static_cast<unsigned>(__builtin_ctzll(~static_cast<
+            unsigned long long>(i)));
+#else
+        unsigned count = 0;
+        for (; i & 1; i >>= 1) ++count;
+        return count;
+#endif
+    }
+
+public:
+
+    // Walks the slots in key order.
+    class const_iterator {
+        const frozen_set * set;
+        std::size_t i;
+
+        friend class frozen_set;
+
+        const_iterator(const frozen_set * set, std::size_t i)
+                : set(set)
+                , i(i) { }
+
+    public:
+
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T *;
+        using reference = const T &;
+
+        const_iterator() : set(nullptr), i(0) { }
+
+        const_iterator & operator++() {
+            if (2 * i + 1 <= set->n()) {
+                i = 2 * i + 1;
+                while (2 * i <= set->n()) i = 2 * i;
+            } else {
+                i >>= count_trailing_ones(i) + 1;
+            }
+            return *this;
+        }
+
+        const_iterator operator++(int) {
+            const_iterator it(*this);
+            ++(*this);
+            return it;
+        }
+
+        const T & operator*() const {
+            return set->keys[i];
+        }
+
+        const T * operator->() const {
+            return &set->keys[i];
+        }
+
+        friend bool operator==(const const_iterator & lhs,
+                               const const_iterator & rhs) {
+            return lhs.i == rhs.i;
+        }
+
+        friend bool operator!=(const const_iterator & lhs,
+                               const const_iterator & rhs) {
+            return lhs.i != rhs.i;
+        }
+    };
+
+    explicit frozen_set(const Compare & comp = Compare())
+            : compare_holder(comp) { }
+
+    // [first, last) must be sorted by Compare.
+    template <typename ForwardIt>
+    frozen_set(ForwardIt first, ForwardIt last, sorted_tag,
+               const Compare & comp = Compare())
+            : frozen_set(first,
+                         static_cast<std::size_t>(std::distance(first, last)),
+                         [](const T & value) -> const T & { return value; },
+                         comp) { }
+
+    bool contains(const T & k) const {
+        auto i = bound<false>(k);
+        return i != 0 && !comp()(k, keys[i]);
+    }
+
+    const_iterator find(const T & k) const {
+        auto i = bound<false>(k);
+        return const_iterator(this, i != 0 && !comp()(k, keys[i]) ? i : 0);
+    }
+
+    const_iterator lower_bound(const T & k) const {
+        return const_iterator(this, bound<false>(k));
+    }
+
+    const_iterator upper_bound(const T & k) const {
+        return const_iterator(this, bound<true>(k));
+    }
+
+    std::size_t size() const {
+        return n();
+    }
+
+    bool empty() const {
+        return n() == 0;
+    }
+
+    const_iterator begin() const {
+        std::size_t i = n() == 0 ? 0 : 1;
+        while (i != 0 && 2 * i <= n()) i = 2 * i;
+        return const_iterator(this, i);
+    }
+
+    const_iterator end() const {
+        return const_iterator(this, 0);
+    }
+
+    // Rebuilds a mutable tree in O(n), e.g. thaw<rb_multiset<T>>().
+    template <typename Tree = rb_tree<T, Compare>>
+    Tree thaw() const {
+        return Tree(begin(), end(), sorted_tag(), comp());
+    }
+
+};
+
+// Copies the values of a set-like tree into a frozen_set in O(n).
+template <bool Prefetch = true, typename Tree>
+frozen_set<typename Tree::value_type, typename Tree::key_compare, Prefetch>
+freeze(const Tree & tree) {
+    using value_type = typename Tree::value_type;
+    static_assert(std::is_same<typename Tree::key_type, value_type>::value,
+                  "only sets can be frozen");
+    return frozen_set<value_type, typename Tree::key_compare, Prefetch>(
+        tree.begin(), tree.size(),
+        [](const value_type & value) -> const value_type & {
+            return value;
+        },
+        tree.key_comp());
+}
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef INTERVAL_TREE_HPP
+#define INTERVAL_TREE_HPP
+
+#include "rb_tree.hpp"
+
+#include <vector>
+
+// Closed interval [lo, hi].
+template <typename Bound>
+struct interval {
+    Bound lo;
+    Bound hi;
+
+    friend bool operator==(const interval & lhs, const interval & rhs) {
+        return lhs.lo == rhs.lo && lhs.hi == rhs.hi;
+    }
+};
+
+template <typename Bound, typename Compare>
+struct interval_less {
+    bool operator()(const interval<Bound> & lhs,
+                    const interval<Bound> & rhs) const {
+        Compare less;
+        if (less(lhs.lo, rhs.lo)) return true;
+        if (less(rhs.lo, lhs.lo)) return false;
+        return less(lhs.hi, rhs.hi);
+    }
+};
+
+// Largest upper bound in the subtree.
+template <typename Bound, typename Compare>
+struct max_endpoint {
+    using metadata = Bound;
+
+    static Bound combine(const interval<Bound> & value,
+                         const Bound * left,
+                         const Bound * right) {
+        Compare less;
+        auto result = value.hi;
+        if (left && less(result, *left)) result = *left;
+        if (right && less(result, *right)) result = *right;
+        return result;
+    }
+};
+
+// Multiset of closed intervals ordered by lower bound, with every node
+// caching the largest upper bound below it. Compare must be stateless.
+template <typename Bound,
+          typename Compare = std::less<Bound>,
+          typename Allocator = std::allocator<interval<Bound>>>
+class interval_tree
+        : public basic_rb_tree<interval<Bound>, interval<Bound>,
+                               identity_key,
+                               interval_less<Bound, Compare>,
+                               Allocator, true,
+                               max_endpoint<Bound, Compare>> {
+    using base = basic_rb_tree<interval<Bound>, interval<Bound>,
+                               identity_key,
+                               interval_less<Bound, Compare>,
+                               Allocator, true,
+                               max_endpoint<Bound, Compare>>;
+    using node = node_base<interval<Bound>>;
+
+    // In-order walk that skips subtrees whose largest upper bound is
+    // below lo, and right subtrees once lower bounds pass hi.
+    template <typename Visitor>
+    static void visit(const node * nil, const node * x,
+                      const Bound & lo, const Bound & hi, Visitor & f) {
+        Compare less;
+        while (x != nil && !less(base::node_metadata(x), lo)) {
+            visit(nil, x->left, lo, hi, f);
+            auto & value = x->get_value();
+            if (less(hi, value.lo)) return;
+            if (!less(value.hi, lo)) f(value);
+            x = x->right;
+        }
+    }
+
+public:
+
+    using base::base;
+
+    typename base::iterator insert(const Bound & lo, const Bound & hi) {
+        return base::insert(interval<Bound>{ lo, hi });
+    }
+
+    using base::insert;
+
+    // Calls f on every stored interval intersecting [lo, hi], in order.
+    // Subtrees that cannot contain a match are never entered, so k
+    // matches cost O(min(n, (k + 1) log n)).
+    template <typename Visitor>
+    void for_each_overlapping(const Bound & lo, const Bound & hi,
+                              Visitor f) const {
+        auto root = this->get_root();
+        visit(root->parent, root, lo, hi, f);
+    }
+
+    std::vector<interval<Bound>> overlapping(const Bound & lo,
+                                             const Bound & hi) const {
+        std::vector<interval<Bound>> result;
+        for_each_overlapping(lo, hi, [&](const interval<Bound> & value) {
+            result.push_back(value);
+        });
+        return result;
+    }
+
+};
+
+#endif
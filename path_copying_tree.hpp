@@ -0,0 +1,388 @@
+#ifndef PATH_COPYING_TREE_HPP
+#define PATH_COPYING_TREE_HPP
+
+#include "rb_tree.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+template <bool Counted>
+struct node_refs { };
+
+// Number of parents and trees holding the node. It starts at one for the
+// tree or copy that creates it.
+template <>
+struct node_refs<true> {
+    mutable std::atomic<std::size_t> refs;
+
+    node_refs() : refs(1) { }
+
+    node_refs(const node_refs &) : refs(1) { }
+};
+
+// Node of a tree without parent links, so that a subtree can be shared
+// by several versions of the tree. Once reachable from a published root
+// a node is never modified again: writers copy it instead.
+template <typename T, bool Counted = false>
+struct immutable_node : node_refs<Counted> {
+    immutable_node * link[2];   // left, right
+    node_color color;
+    T value;
+
+    template <typename... Args>
+    explicit immutable_node(node_color color, Args &&... args)
+            : link{ nullptr, nullptr }
+            , color(color)
+            , value(std::forward<Args>(args)...) { }
+
+    immutable_node(const immutable_node & other)
+            : node_refs<Counted>(other)
+            , link{ other.link[0], other.link[1] }
+            , color(other.color)
+            , value(other.value) { }
+};
+
+// In-order walk of an immutable tree. Without parent links the way back
+// up is kept on a stack, which a red-black tree of 2^64 nodes bounds to
+// 128 entries.
+template <typename T, bool Counted = false>
+class immutable_tree_iterator {
+    static constexpr int max_depth = 128;
+
+    const immutable_node<T, Counted> * stack[max_depth];
+    int depth;
+
+    void push_left(const immutable_node<T, Counted> * x) {
+        for (; x; x = x->link[0]) stack[depth++] = x;
+    }
+
+public:
+
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const T *;
+    using reference = const T &;
+
+    explicit immutable_tree_iterator(
+            const immutable_node<T, Counted> * root = nullptr)
+            : depth(0) {
+        push_left(root);
+    }
+
+    immutable_tree_iterator & operator++() {
+        auto x = stack[--depth];
+        push_left(x->link[1]);
+        return *this;
+    }
+
+    const T & operator*() const {
+        return stack[depth - 1]->value;
+    }
+
+    const T * operator->() const {
+        return &stack[depth - 1]->value;
+    }
+
+    friend bool operator==(const immutable_tree_iterator & lhs,
+                           const immutable_tree_iterator & rhs) {
+        if (lhs.depth != rhs.depth) return false;
+        return lhs.depth == 0 ||
+               lhs.stack[lhs.depth - 1] == rhs.stack[rhs.depth - 1];
+    }
+
+    friend bool operator!=(const immutable_tree_iterator & lhs,
+                           const immutable_tree_iterator & rhs) {
+        return !(lhs == rhs);
+    }
+
+};
+
+// Insert and erase by path copying for trees of immutable_node. A
+// published node is never written: the nodes an update touches are copied
+// first and the copies are rebalanced the way fixup_insert/fixup_erase
+// rebalance a mutable tree, with the path kept on a stack instead of in
+// parent links. Derived supplies
+//
+//     const Compare & comp() const;
+//     node * clone_node(node * x);         // private copy of x
+//     void destroy_node(node * x);         // frees x alone
+//     void abandon(update & u);            // undoes a failed update
+//     template <typename... Args>
+//     node * create_node(Args &&... args);
+//
+// and decides what happens to the replaced nodes, which are left in
+// update::retired.
+template <typename Derived, typename Node>
+class path_copying_tree {
+protected:
+
+    using node = Node;
+
+    static constexpr int max_depth = 128;
+
+    // A writer's private copy of the nodes an update touches. path holds
+    // copies from the root down, dir[i] is the side of path[i] on which
+    // path[i + 1] hangs, top is the new root, and created/retired list the
+    // copies and the originals they replace.
+    struct update {
+        node * path[max_depth + 1];
+        int dir[max_depth + 1];
+        int depth = 0;
+        node * top = nullptr;
+        std::vector<node *> retired;
+        std::vector<node *> created;
+    };
+
+    Derived & derived() {
+        return static_cast<Derived &>(*this);
+    }
+
+    static bool is_red(const node * x) {
+        return x && x->color == red;
+    }
+
+    template <typename K, typename Compare>
+    static const node * find_node(const node * x, const K & k,
+                                  const Compare & comp) {
+        while (x) {
+            if (comp(k, x->value)) {
+                x = x->link[0];
+            } else if (comp(x->value, k)) {
+                x = x->link[1];
+            } else {
+                return x;
+            }
+        }
+        return nullptr;
+    }
+
+    node * copy_node(update & u, node * x) {
+        auto z = derived().clone_node(x);
+        u.created.push_back(z);
+        u.retired.push_back(x);
+        return z;
+    }
+
+    // Sets what hangs below path[i - 1] (or the root, for i == 0).
+    static void relink(update & u, int i, node * x) {
+        if (i == 0) {
+            u.top = x;
+        } else {
+            u.path[i - 1]->link[u.dir[i - 1]] = x;
+        }
+    }
+
+    // Rotates path[i] towards side d; its child on the other side takes
+    // its place. Both must be private copies.
+    static node * rotate(update & u, int i, int d) {
+        auto x = u.path[i];
+        auto y = x->link[!d];
+        x->link[!d] = y->link[d];
+        y->link[d] = x;
+        relink(u, i, y);
+        return y;
+    }
+
+    // Copies the root-to-node path recorded in u.path.
+    void copy_path(update & u) {
+        node * parent = nullptr;
+        for (int i = 0; i < u.depth; ++i) {
+            auto z = copy_node(u, u.path[i]);
+            if (parent) {
+                parent->link[u.dir[i - 1]] = z;
+            } else {
+                u.top = z;
+            }
+            u.path[i] = z;
+            parent = z;
+        }
+    }
+
+    // Builds in u the tree rooted at x with a node made of args added
+    // under key k. Returns false, leaving u empty, if k is present.
+    template <typename K, typename... Args>
+    bool insert_path(update & u, node * x, const K & k, Args &&... args) {
+        auto & comp = derived().comp();
+        u.top = x;
+        while (x) {
+            int d;
+            if (comp(k, x->value)) {
+                d = 0;
+            } else if (comp(x->value, k)) {
+                d = 1;
+            } else {
+                return false;
+            }
+            u.path[u.depth] = x;
+            u.dir[u.depth++] = d;
+            x = x->link[d];
+        }
+        try {
+            copy_path(u);
+            auto z = derived().create_node(red,
+                                           std::forward<Args>(args)...);
+            u.created.push_back(z);
+            relink(u, u.depth, z);
+            u.path[u.depth] = z;
+            fixup_insert(u, u.depth);
+        } catch (...) {
+            derived().abandon(u);
+            throw;
+        }
+        u.top->color = black;
+        return true;
+    }
+
+    // The copy of fixup_insert for a stack of private copies; i is the
+    // depth of the red node z. The uncle is the only node off the path
+    // that changes, and it gets copied first.
+    void fixup_insert(update & u, int i) {
+        while (i >= 2 && is_red(u.path[i - 1])) {
+            auto g = u.path[i - 2];
+            int d = u.dir[i - 2];
+            auto uncle = g->link[!d];
+            if (is_red(uncle)) {
+                uncle = copy_node(u, uncle);
+                g->link[!d] = uncle;
+                uncle->color = black;
+                u.path[i - 1]->color = black;
+                g->color = red;
+                i -= 2;
+                continue;
+            }
+            if (u.dir[i - 1] != d) {
+                // z is an inner grandchild: lift it above its parent
+                rotate(u, i - 1, d);
+                std::swap(u.path[i - 1], u.path[i]);
+            }
+            u.path[i - 1]->color = black;
+            g->color = red;
+            rotate(u, i - 2, !d);
+            break;
+        }
+    }
+
+    // Builds in u the tree rooted at x without the node of key k. Returns
+    // false, leaving u empty, if there is none.
+    template <typename K>
+    bool erase_path(update & u, node * x, const K & k) {
+        auto & comp = derived().comp();
+        u.top = x;
+        auto push = [&](node * y, int d) {
+            u.path[u.depth] = y;
+            u.dir[u.depth++] = d;
+        };
+        while (x) {
+            int d;
+            if (comp(k, x->value)) {
+                d = 0;
+            } else if (comp(x->value, k)) {
+                d = 1;
+            } else {
+                break;
+            }
+            push(x, d);
+            x = x->link[d];
+        }
+        if (!x) return false;
+        int z_depth = u.depth;
+        if (x->link[0] && x->link[1]) {
+            // continue down to the successor, whose child is on the right
+            push(x, 1);
+            for (x = x->link[1]; x->link[0]; x = x->link[0]) push(x, 0);
+            push(x, 1);
+        } else {
+            push(x, x->link[0] ? 0 : 1);
+        }
+        try {
+            copy_path(u);
+            remove(u, z_depth);
+        } catch (...) {
+            derived().abandon(u);
+            throw;
+        }
+        return true;
+    }
+
+    // Unlinks the last node of the path, which has at most one child; if
+    // that is not z itself it is z's successor and takes z's place.
+    void remove(update & u, int z_depth) {
+        int i = u.depth - 1;
+        auto y = u.path[i];
+        auto z = u.path[z_depth];
+        auto x = y->link[u.dir[i]];
+        auto removed_color = y->color;
+        if (x) {
+            // a lone child is red below a black y and turns black
+            x = copy_node(u, x);
+        }
+        relink(u, i, x);
+        if (y != z) {
+            y->link[0] = z->link[0];
+            y->link[1] = z->link[1];
+            y->color = z->color;
+            relink(u, z_depth, y);
+            u.path[z_depth] = y;
+        }
+        // the copy of z was never published; its links went to y
+        u.created.erase(std::find(u.created.begin(), u.created.end(), z));
+        derived().destroy_node(z);
+        if (removed_color == black) fixup_erase(u, i, x);
+    }
+
+    // The copy of fixup_erase for a stack of private copies: x, which may
+    // be null, hangs at depth i below path[i - 1]. Siblings and nephews
+    // are copied before they change.
+    void fixup_erase(update & u, int i, node * x) {
+        while (i > 0 && !is_red(x)) {
+            auto p = u.path[i - 1];
+            int d = u.dir[i - 1];
+            auto w = copy_node(u, p->link[!d]);
+            p->link[!d] = w;
+            if (w->color == red) {
+                w->color = black;
+                p->color = red;
+                rotate(u, i - 1, d);
+                // w is now above p on the path
+                u.path[i] = p;
+                u.dir[i] = d;
+                u.path[i - 1] = w;
+                u.dir[i - 1] = d;
+                ++i;
+                w = copy_node(u, p->link[!d]);
+                p->link[!d] = w;
+            }
+            if (!is_red(w->link[0]) && !is_red(w->link[1])) {
+                w->color = red;
+                x = p;
+                --i;
+                continue;
+            }
+            if (!is_red(w->link[!d])) {
+                auto inner = copy_node(u, w->link[d]);
+                inner->color = black;
+                w->color = red;
+                w->link[d] = inner->link[!d];
+                inner->link[!d] = w;
+                p->link[!d] = inner;
+                w = inner;
+            }
+            auto outer = copy_node(u, w->link[!d]);
+            w->link[!d] = outer;
+            w->color = p->color;
+            p->color = black;
+            outer->color = black;
+            rotate(u, i - 1, d);
+            return;
+        }
+        if (x) x->color = black;
+    }
+
+};
+
+#endif
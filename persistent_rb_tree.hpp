@@ -0,0 +1,213 @@
+#ifndef PERSISTENT_RB_TREE_HPP
+#define PERSISTENT_RB_TREE_HPP
+
+#include "path_copying_tree.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <utility>
+
+// Set with cheap versions: copying a persistent_rb_tree takes O(1) and
+// shares every node, and each insert or erase on one copy allocates
+// O(log n) new nodes without affecting the others. Nodes are reference
+// counted and freed with the last version that reaches them.
+//
+// Like std::shared_ptr, different copies may be used and destroyed on
+// different threads, while one copy needs external synchronization. Any
+// copy may free shared nodes, so the allocator has to be usable from all
+// of those threads.
+template <typename T,
+          typename Compare = std::less<T>,
+          typename Allocator = std::allocator<T>>
+class persistent_rb_tree
+        : private ebo_storage<Compare, 0>
+        , private ebo_storage<typename std::allocator_traits<Allocator>::
+                template rebind_alloc<immutable_node<T, true>>, 1>
+        , private path_copying_tree<
+                persistent_rb_tree<T, Compare, Allocator>,
+                immutable_node<T, true>> {
+    using node = immutable_node<T, true>;
+    using node_allocator = typename std::allocator_traits<Allocator>::
+        template rebind_alloc<node>;
+    using node_alloc_traits = std::allocator_traits<node_allocator>;
+    using compare_holder = ebo_storage<Compare, 0>;
+    using allocator_holder = ebo_storage<node_allocator, 1>;
+    using core = path_copying_tree<persistent_rb_tree, node>;
+    using update = typename core::update;
+
+    friend core;
+
+    node * root;
+    std::size_t node_count;
+
+    const Compare & comp() const {
+        return compare_holder::get();
+    }
+
+    node_allocator & alloc() {
+        return allocator_holder::get();
+    }
+
+    template <typename... Args>
+    node * create_node(Args &&... args) {
+        auto z = node_alloc_traits::allocate(alloc(), 1);
+        try {
+            node_alloc_traits::construct(alloc(), z,
+                                         std::forward<Args>(args)...);
+        } catch (...) {
+            node_alloc_traits::deallocate(alloc(), z, 1);
+            throw;
+        }
+        return z;
+    }
+
+    void destroy_node(node * x) {
+        node_alloc_traits::destroy(alloc(), x);
+        node_alloc_traits::deallocate(alloc(), x, 1);
+    }
+
+    node * clone_node(node * x) {
+        auto z = create_node(*x);
+        for (auto child : z->link) {
+            if (child) child->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+        return z;
+    }
+
+    // Drops one reference to x, freeing whatever only it held.
+    void release(node * x) {
+        while (x && x->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            release(x->link[0]);
+            auto next = x->link[1];
+            destroy_node(x);
+            x = next;
+        }
+    }
+
+    // The copies hold references to originals they were made from; those
+    // go back, and the originals are still held by this version.
+    void abandon(update & u) {
+        for (auto x : u.created) {
+            for (auto child : x->link) {
+                if (child && std::find(u.created.begin(), u.created.end(),
+                                       child) == u.created.end()) {
+                    child->refs.fetch_sub(1, std::memory_order_relaxed);
+                }
+            }
+        }
+        for (auto x : u.created) destroy_node(x);
+    }
+
+    // Switches this version to u.top. Every original in u.retired lost one
+    // holder: its copy's parent, or this tree for the old root.
+    void commit(update & u) {
+        root = u.top;
+        for (auto x : u.retired) release(x);
+    }
+
+public:
+
+    using iterator = immutable_tree_iterator<T, true>;
+
+    explicit persistent_rb_tree(const Compare & comp = Compare(),
+                                const Allocator & alloc = Allocator())
+            : compare_holder(comp)
+            , allocator_holder(node_allocator(alloc))
+            , root(nullptr)
+            , node_count(0) { }
+
+    // O(1): both trees share all nodes until one of them changes.
+    persistent_rb_tree(const persistent_rb_tree & other)
+            : compare_holder(other.comp())
+            , allocator_holder(node_alloc_traits::
+                  select_on_container_copy_construction(
+                      other.allocator_holder::get()))
+            , root(other.root)
+            , node_count(other.node_count) {
+        if (root) root->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    persistent_rb_tree(persistent_rb_tree && other) noexcept
+            : compare_holder(other.comp())
+            , allocator_holder(std::move(other.alloc()))
+            , root(other.root)
+            , node_count(other.node_count) {
+        other.root = nullptr;
+        other.node_count = 0;
+    }
+
+    // Both sides must use equal allocators, as any version may free
+    // nodes allocated by another.
+    persistent_rb_tree & operator=(persistent_rb_tree other) noexcept {
+        std::swap(root, other.root);
+        std::swap(node_count, other.node_count);
+        return *this;
+    }
+
+    ~persistent_rb_tree() {
+        release(root);
+    }
+
+    // Both return false, and change nothing, if the key is already
+    // present (insert) or absent (erase).
+    bool insert(const T & value) {
+        update u;
+        if (!this->insert_path(u, root, value, value)) return false;
+        commit(u);
+        ++node_count;
+        return true;
+    }
+
+    bool insert(T && value) {
+        update u;
+        if (!this->insert_path(u, root, value, std::move(value))) {
+            return false;
+        }
+        commit(u);
+        ++node_count;
+        return true;
+    }
+
+    bool erase(const T & k) {
+        update u;
+        if (!this->erase_path(u, root, k)) return false;
+        commit(u);
+        --node_count;
+        return true;
+    }
+
+    const T * find(const T & k) const {
+        auto x = core::find_node(root, k, comp());
+        return x ? &x->value : nullptr;
+    }
+
+    bool contains(const T & k) const {
+        return find(k) != nullptr;
+    }
+
+    std::size_t size() const {
+        return node_count;
+    }
+
+    bool empty() const {
+        return node_count == 0;
+    }
+
+    const immutable_node<T, true> * get_root() const {
+        return root;
+    }
+
+    iterator begin() const {
+        return iterator(root);
+    }
+
+    iterator end() const {
+        return iterator();
+    }
+
+};
+
+#endif
@@ -0,0 +1,220 @@
+#ifndef POOL_ALLOCATOR_HPP
+#define POOL_ALLOCATOR_HPP
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Slab of fixed-size slots. Memory is carved from large chunks and freed
+// slots are kept on a per-size free list, so single-object allocations
+// never reach malloc after warm-up. Not thread safe.
+class node_pool {
+    struct free_slot {
+        free_slot * next;
+    };
+
+    struct size_class {
+        std::size_t size;
+        free_slot * free_list;
+        char * cursor;
+        char * end;
+    };
+
+    std::size_t slots_per_chunk;
+    std::vector<size_class> classes;
+    std::vector<void *> chunks;
+
+    static std::size_t round_up(std::size_t size) {
+        const std::size_t align = alignof(std::max_align_t);
+        if (size < sizeof(free_slot)) size = sizeof(free_slot);
+        return (size + align - 1) / align * align;
+    }
+
+    size_class & find_class(std::size_t size) {
+        for (auto & c : classes) {
+            if (c.size == size) return c;
+        }
+        classes.push_back({ size, nullptr, nullptr, nullptr });
+        return classes.back();
+    }
+
+    void add_chunk(size_class & c, std::size_t slots) {
+        // room first, so push_back cannot throw and leak the chunk;
+        // doubling keeps that O(1) amortized
+        if (chunks.size() == chunks.capacity()) {
+            chunks.reserve(2 * chunks.size() + 1);
+        }
+        auto chunk = static_cast<char *>(::operator new(c.size * slots));
+        chunks.push_back(chunk);
+        // the tail of the previous chunk stays usable via the free list
+        while (c.cursor != c.end) {
+            auto slot = reinterpret_cast<free_slot *>(c.cursor);
+            slot->next = c.free_list;
+            c.free_list = slot;
+            c.cursor += c.size;
+        }
+        c.cursor = chunk;
+        c.end = chunk + c.size * slots;
+    }
+
+public:
+
+    explicit node_pool(std::size_t slots_per_chunk)
+            : slots_per_chunk(slots_per_chunk) { }
+
+    node_pool(const node_pool &) = delete;
+
+    node_pool & operator=(const node_pool &) = delete;
+
+    ~node_pool() {
+        release();
+    }
+
+    void * allocate(std::size_t size) {
+        auto & c = find_class(round_up(size));
+        if (c.free_list) {
+            auto slot = c.free_list;
+            c.free_list = slot->next;
+            return slot;
+        }
+        if (c.cursor == c.end) {
+            add_chunk(c, slots_per_chunk);
+        }
+        auto slot = c.cursor;
+        c.cursor += c.size;
+        return slot;
+    }
+
+    // Makes room for n more slots of this size in a single chunk.
+    void reserve(std::size_t size, std::size_t n) {
+        auto & c = find_class(round_up(size));
+        if (static_cast<std::size_t>(c.end - c.cursor) / c.size < n) {
+            add_chunk(c, n);
+        }
+    }
+
+    void deallocate(void * p, std::size_t size) noexcept {
+        auto & c = find_class(round_up(size));
+        auto slot = static_cast<free_slot *>(p);
+        slot->next = c.free_list;
+        c.free_list = slot;
+    }
+
+    // Returns every chunk to the system at once. Objects still living in
+    // the pool are not destroyed.
+    void release() noexcept {
+        for (auto chunk : chunks) {
+            ::operator delete(chunk);
+        }
+        chunks.clear();
+        for (auto & c : classes) {
+            c.free_list = nullptr;
+            c.cursor = nullptr;
+            c.end = nullptr;
+        }
+    }
+
+};
+
+// Std-compatible allocator backed by a shared node_pool. Rebound copies
+// share the pool, which is released when the last copy goes away. Only
+// single-object allocations use the pool; arrays go to operator new.
+template <typename T, std::size_t NodesPerChunk = 1024>
+class pool_allocator {
+    template <typename, std::size_t> friend class pool_allocator;
+
+    std::shared_ptr<node_pool> pool;
+
+public:
+
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::false_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    template <typename U>
+    struct rebind {
+        using other = pool_allocator<U, NodesPerChunk>;
+    };
+
+    pool_allocator()
+            : pool(std::make_shared<node_pool>(NodesPerChunk)) { }
+
+    // Copies (including "moves") always share the pool, so an allocator is
+    // never left without one.
+    pool_allocator(const pool_allocator & other) noexcept = default;
+
+    template <typename U>
+    pool_allocator(const pool_allocator<U, NodesPerChunk> & other) noexcept
+            : pool(other.pool) { }
+
+    T * allocate(std::size_t n) {
+        static_assert(alignof(T) <= alignof(std::max_align_t),
+                      "over-aligned types are not supported");
+        if (n != 1) {
+            return static_cast<T *>(::operator new(n * sizeof(T)));
+        }
+        return static_cast<T *>(pool->allocate(sizeof(T)));
+    }
+
+    void deallocate(T * p, std::size_t n) noexcept {
+        if (n != 1) {
+            ::operator delete(p);
+        } else {
+            pool->deallocate(p, sizeof(T));
+        }
+    }
+
+    // Pre-carves room for n single-object allocations.
+    void reserve(std::size_t n) {
+        pool->reserve(sizeof(T), n);
+    }
+
+    // A copied container gets a pool of its own, so it can later be torn
+    // down in bulk independently of the original.
+    pool_allocator select_on_container_copy_construction() const {
+        return pool_allocator();
+    }
+
+    // Frees all chunks at once if no other allocator shares the pool.
+    // Returns false and does nothing otherwise.
+    bool try_release_all() noexcept {
+        if (pool.use_count() != 1) return false;
+        pool->release();
+        return true;
+    }
+
+    template <typename U>
+    friend bool operator==(const pool_allocator & lhs,
+                           const pool_allocator<U, NodesPerChunk> & rhs) {
+        return lhs.pool == pool_allocator(rhs).pool;
+    }
+
+    template <typename U>
+    friend bool operator!=(const pool_allocator & lhs,
+                           const pool_allocator<U, NodesPerChunk> & rhs) {
+        return !(lhs == rhs);
+    }
+
+};
+
+template <typename Alloc, typename = void>
+struct has_bulk_release : std::false_type { };
+
+template <typename Alloc>
+struct has_bulk_release<Alloc,
+        decltype(void(std::declval<Alloc &>().try_release_all()))>
+        : std::true_type { };
+
+template <typename Alloc, typename = void>
+struct has_node_reserve : std::false_type { };
+
+template <typename Alloc>
+struct has_node_reserve<Alloc,
+        decltype(void(std::declval<Alloc &>().reserve(std::size_t())))>
+        : std::true_type { };
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef RB_MAP_HPP
+#define RB_MAP_HPP
+
+#include "rb_tree.hpp"
+
+#include <stdexcept>
+#include <tuple>
+
+template <typename Key,
+          typename Value,
+          typename Compare = std::less<Key>,
+          typename Allocator = std::allocator<std::pair<const Key, Value>>>
+class rb_map
+        : public basic_rb_tree<Key, std::pair<const Key, Value>,
+                               pair_first_key, Compare, Allocator, false> {
+    using base = basic_rb_tree<Key, std::pair<const Key, Value>,
+                               pair_first_key, Compare, Allocator, false>;
+    using node = node_base<std::pair<const Key, Value>>;
+
+    template <typename K, typename... Args>
+    std::pair<node *, bool> try_emplace_key(K && k, Args &&... args) {
+        auto position = this->find_insert_position(k);
+        if (position.existing) return { position.existing, false };
+        auto z = this->create_node(
+            std::in_place, std::piecewise_construct,
+            std::forward_as_tuple(std::forward<K>(k)),
+            std::forward_as_tuple(std::forward<Args>(args)...));
+        this->attach(z, position);
+        return { z, true };
+    }
+
+    template <typename K, typename M>
+    std::pair<node *, bool> insert_or_assign_key(K && k, M && value) {
+        auto position = this->find_insert_position(k);
+        if (position.existing) {
+            position.existing->get_value().second = std::forward<M>(value);
+            return { position.existing, false };
+        }
+        auto z = this->create_node(std::in_place, std::forward<K>(k),
+                                   std::forward<M>(value));
+        this->attach(z, position);
+        return { z, true };
+    }
+
+    std::pair<typename base::iterator, bool> result(
+            std::pair<node *, bool> r) {
+        return { this->iterator_to(r.first), r.second };
+    }
+
+public:
+
+    using typename base::iterator;
+
+    using base::base;
+
+    Value & operator[](const Key & k) {
+        return try_emplace_key(k).first->get_value().second;
+    }
+
+    Value & operator[](Key && k) {
+        return try_emplace_key(std::move(k)).first->get_value().second;
+    }
+
+    Value & at(const Key & k) {
+        auto x = this->find_insert_position(k).existing;
+        if (!x) throw std::out_of_range("rb_map::at: key not found");
+        return x->get_value().second;
+    }
+
+    const Value & at(const Key & k) const {
+        auto x = this->find_insert_position(k).existing;
+        if (!x) throw std::out_of_range("rb_map::at: key not found");
+        return x->get_value().second;
+    }
+
+    // Construct the mapped value only if the key is absent; both this and
+    // insert_or_assign descend the tree once.
+    template <typename... Args>
+    std::pair<iterator, bool> try_emplace(const Key & k, Args &&... args) {
+        return result(try_emplace_key(k, std::forward<Args>(args)...));
+    }
+
+    template <typename... Args>
+    std::pair<iterator, bool> try_emplace(Key && k, Args &&... args) {
+        return result(try_emplace_key(std::move(k),
+                                      std::forward<Args>(args)...));
+    }
+
+    template <typename M>
+    std::pair<iterator, bool> insert_or_assign(const Key & k, M && value) {
+        return result(insert_or_assign_key(k, std::forward<M>(value)));
+    }
+
+    template <typename M>
+    std::pair<iterator, bool> insert_or_assign(Key && k, M && value) {
+        return result(insert_or_assign_key(std::move(k),
+                                           std::forward<M>(value)));
+    }
+
+};
+
+template <typename Key,
+          typename Value,
+          typename Compare = std::less<Key>,
+          typename Allocator = std::allocator<std::pair<const Key, Value>>>
+using rb_multimap =
+    basic_rb_tree<Key, std::pair<const Key, Value>,
+                  pair_first_key, Compare, Allocator, true>;
+
+#endif
@@ -2,9 +2,23 @@
 #define RB_TREE_HPP
 
 #include <memory>
+#include <optional>
 #include <iostream>
 #include <iomanip>
 #include <stack>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "executor.hpp"
+#include "pool_allocator.hpp"
 
 enum node_color { black, red };
 
@@ -15,7 +29,7 @@ struct node_base {
     node_base * parent;
     node_color color;
 
-    node_base()
+    constexpr node_base()
             : right(this)
             , left(this)
             , parent(this)
@@ -33,19 +47,25 @@ struct node_base {
         if (left) left->parent = this;
     }
 
-    virtual ~node_base() { }
+    const T & get_value() const;
 
-    virtual const T & get_value() const {
-        throw std::logic_error("this node doesn't have a value");
-    }
+    T & get_value();
+
+    // Leaf sentinel shared by every tree of T. It is black, links to
+    // itself and is never written to, so subtrees can move from one tree
+    // to another without relinking their leaves.
+    static node_base sentinel;
 
 };
 
 template <typename T>
-class node_with_value : public node_base<T> {
-    T value;
+node_base<T> node_base<T>::sentinel;
 
-public:
+// Value-carrying node. The sentinel is a bare node_base, so get_value()
+// is a plain static_cast and must never be called on it.
+template <typename T>
+struct node_with_value : node_base<T> {
+    T value;
 
     node_with_value(node_base<T> * right,
                     node_base<T> * left,
@@ -59,29 +79,101 @@ public:
             : node_base<T>()
             , value(value) { }
 
-    const T & get_value() const override {
-        return value;
-    }
+    template <typename... Args>
+    explicit node_with_value(std::in_place_t, Args &&... args)
+            : node_base<T>()
+            , value(std::forward<Args>(args)...) { }
+
+};
+
+template <typename T>
+inline const T & node_base<T>::get_value() const {
+    return static_cast<const node_with_value<T> *>(this)->value;
+}
+
+template <typename T>
+inline T & node_base<T>::get_value() {
+    return static_cast<node_with_value<T> *>(this)->value;
+}
 
+// Node of an augmented tree: also caches a summary of its subtree.
+template <typename T, typename Metadata>
+struct augmented_node : node_with_value<T> {
+    Metadata metadata;
+
+    using node_with_value<T>::node_with_value;
 };
 
+// Node of a linked tree: also points to its neighbours in key order, or
+// to the sentinel past either end.
 template <typename T>
+struct linked_node : node_with_value<T> {
+    node_base<T> * next;
+    node_base<T> * prev;
+
+    using node_with_value<T>::node_with_value;
+};
+
+// Augmentation policies describe the per-node metadata of a tree and how
+// to compute it from a node's element and its children's metadata (null
+// for an empty subtree). A policy provides
+//
+//     using metadata = M;
+//     static M combine(const T & value, const M * left, const M * right);
+//
+// combine must depend on nothing but its arguments: the tree calls it on
+// both rotated nodes in left_rotate/right_rotate and on the path to the
+// root after every insertion and removal, so each update costs
+// O(log n) calls. no_augment stores nothing.
+struct no_augment { };
+
+// Keeps subtree sizes, which gives the tree select() and rank().
+struct subtree_size {
+    using metadata = std::size_t;
+
+    template <typename T>
+    static std::size_t combine(const T &,
+                               const std::size_t * left,
+                               const std::size_t * right) {
+        return 1 + (left ? *left : 0) + (right ? *right : 0);
+    }
+};
+
+// Walks a tree in order. end() is the sentinel; the tree's header, whose
+// left and right are the first and last nodes, lets it step back from
+// there. Over a linked tree (Linked) each step follows one link;
+// otherwise it climbs or descends the tree, O(log n) at worst and O(1)
+// on average.
+template <typename T, bool Linked = false>
 class const_rb_tree_iterator {
+    static constexpr const node_base<T> * nil = &node_base<T>::sentinel;
+
     const node_base<T> * node;
-    const node_base<T> * nil;
+    const node_base<T> * header;
 
 public:
 
-    const_rb_tree_iterator(const node_base<T> * node,
-                           const node_base<T> * nil = nullptr)
+    using iterator_category = std::bidirectional_iterator_tag;
+    using value_type = node_base<T>;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const node_base<T> *;
+    using reference = const node_base<T> &;
+
+    const_rb_tree_iterator(const node_base<T> * node = nil,
+                           const node_base<T> * header = nullptr)
             : node(node)
-            , nil(nil) { }
+            , header(header) { }
 
     const_rb_tree_iterator & operator++() {
+        if constexpr (Linked) {
+            node = static_cast<const linked_node<T> *>(node)->next;
+            return *this;
+        }
         if (node->right == nil) {
-            const node_base<T> * parent;
-            while ((parent = node->parent)->right == node) {
+            auto parent = node->parent;
+            while (parent != nil && parent->right == node) {
                 node = parent;
+                parent = parent->parent;
             }
             node = parent;
         } else {
@@ -101,13 +193,18 @@ public:
 
     const_rb_tree_iterator & operator--() {
         if (node == nil) {
-            node = node->right;
+            node = header->right;
+            return *this;
+        }
+        if constexpr (Linked) {
+            node = static_cast<const linked_node<T> *>(node)->prev;
             return *this;
         }
         if (node->left == nil) {
-            const node_base<T> * parent;
-            while ((parent = node->parent)->left == node) {
+            auto parent = node->parent;
+            while (parent != nil && parent->left == node) {
                 node = parent;
+                parent = parent->parent;
             }
             node = parent;
         } else {
@@ -125,378 +222,2597 @@ public:
         return it;
     }
 
-    const node_base<T> & operator*() {
+    const node_base<T> & operator*() const {
         return *node;
     }
 
-    const node_base<T> * operator->() {
+    const node_base<T> * operator->() const {
         return node;
     }
 
     friend bool operator==(const const_rb_tree_iterator & lhs,
                            const const_rb_tree_iterator & rhs) {
-        return lhs.nil == rhs.nil && lhs.node == rhs.node;
+        return lhs.node == rhs.node;
     }
 
     friend bool operator!=(const const_rb_tree_iterator & lhs,
                            const const_rb_tree_iterator & rhs) {
-        return lhs.nil != rhs.nil || lhs.node != rhs.node;
+        return lhs.node != rhs.node;
     }
 
 };
 
-template <typename T>
-class rb_tree {
-    node_base<T> * root;
+// Walks a tree like const_rb_tree_iterator, but dereferences to the
+// values themselves, for <algorithm> and std::reverse_iterator. Value is
+// const T, or T where values can change in place without breaking the
+// order. Converts to const_rb_tree_iterator, so it is accepted wherever
+// the tree takes a position.
+template <typename T, typename Value, bool Linked = false>
+class rb_tree_value_iterator {
+    const_rb_tree_iterator<T, Linked> it;
 
-    void free_nodes(const node_base<T> * x) {
-        while (x != root->parent) {
-            free_nodes(x->left);
-            auto y = x->right;
-            delete x;
-            x = y;
-        }
+public:
+
+    using iterator_category = std::bidirectional_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+    using pointer = Value *;
+    using reference = Value &;
+
+    rb_tree_value_iterator() = default;
+
+    explicit rb_tree_value_iterator(const_rb_tree_iterator<T, Linked> it)
+            : it(it) { }
+
+    // From the mutable to the const iterator.
+    template <typename Other, typename = typename std::enable_if<
+                  !std::is_const<Other>::value &&
+                  std::is_same<const Other, Value>::value>::type>
+    rb_tree_value_iterator(
+            const rb_tree_value_iterator<T, Other, Linked> & other)
+            : it(other) { }
+
+    operator const_rb_tree_iterator<T, Linked>() const {
+        return it;
     }
 
-    node_base<T> * copy(const node_base<T> * nil,
-                        const node_base<T> * node) const {
-        if (nil == node) return root->parent;
-        node_base<T> * new_node = new node_with_value<T>(node->value);
-        new_node->color = node->color;
-        new_node->right = root->parent;
-        new_node->left = root->parent;
-        try {
-            new_node->right = copy(nil, node->right);
-            new_node->left = copy(nil, node->left);
-        } catch (...) {
-            free_nodes(new_node);
-            throw;
-        }
+    rb_tree_value_iterator & operator++() {
+        ++it;
+        return *this;
     }
 
-    void left_rotate(node_base<T> * x) {
-        auto y = x->right;
-        x->right = y->left;
-        if (y->left != root->parent) {
-            y->left->parent = x;
-        }
-        y->parent = x->parent;
-        if (x->parent == root->parent) {
-            root = y;
-        } else if (x == x->parent->left) {
-            x->parent->left = y;
-        } else {
-            x->parent->right = y;
-        }
-        y->left = x;
-        x->parent = y;
+    rb_tree_value_iterator operator++(int) {
+        rb_tree_value_iterator result(*this);
+        ++it;
+        return result;
     }
 
-    void right_rotate(node_base<T> * x) {
-        auto y = x->left;
-        x->left = y->right;
-        if (y->right != root->parent) {
-            y->right->parent = x;
-        }
-        y->parent = x->parent;
-        if (x->parent == root->parent) {
-            root = y;
-        } else if (x == x->parent->right) {
-            x->parent->right = y;
-        } else {
-            x->parent->left = y;
-        }
-        y->right = x;
-        x->parent = y;
+    rb_tree_value_iterator & operator--() {
+        --it;
+        return *this;
     }
 
-    void fixup_insert(node_base<T> * z) {
-        while (z->parent->color == red) {
-            if (z->parent == z->parent->parent->left) {
-                auto y = z->parent->parent->right;
-                if (y->color == red) {
-                    z->parent->color = black;
-                    y->color = black;
-                    z->parent->parent->color = red;
-                    z = z->parent->parent;
-                } else {
-                    if (z == z->parent->right) {
-                        z = z->parent;
-                        left_rotate(z);
-                    }
-                    z->parent->color = black;
-                    z->parent->parent->color = red;
-                    right_rotate(z->parent->parent);
-                }
-            } else {
-                auto y = z->parent->parent->left;
-                if (y->color == red) {
-                    z->parent->color = black;
-                    y->color = black;
-                    z->parent->parent->color = red;
-                    z = z->parent->parent;
-                } else {
-                    if (z == z->parent->left) {
-                        z = z->parent;
-                        right_rotate(z);
-                    }
-                    z->parent->color = black;
-                    z->parent->parent->color = red;
-                    left_rotate(z->parent->parent);
-                }
-            }
-        }
-        root->color = black;
+    rb_tree_value_iterator operator--(int) {
+        rb_tree_value_iterator result(*this);
+        --it;
+        return result;
     }
 
-    bool insert(node_base<T> * z) {
-        auto y = root->parent;
-        auto x = root;
-        while (root->parent != x) {
-            y = x;
-            if (z->get_value() < x->get_value()) {
-                x = x->left;
-            } else if (x->get_value() < z->get_value()) {
-                x = x->right;
-            } else {
-                return false;
-            }
-        }
-        z->parent = y;
-        if (root->parent == y) {
-            root = z;
-        } else if (z->get_value() < y->get_value()) {
-            y->left = z;
-        } else {
-            y->right = z;
-        }
-        z->left = root->parent;
-        z->right = root->parent;
-        z->color = red;
-        fixup_insert(z);
-        if (root == z) {
-            z->parent->right = z;
-            z->parent->left = z;
-        } else {
-            if (z->get_value() < root->parent->left->get_value()) {
-                root->parent->left = z;
-            } else if (root->parent->right->get_value()
-                       < z->get_value()) {
-                root->parent->right = z;
-            }
-        }
-        return true;
+    // Nodes are never const objects, only seen through const pointers.
+    Value & operator*() const {
+        return const_cast<Value &>(it->get_value());
     }
 
-    void transplant(node_base<T> * u, node_base<T> * v) {
-        if (u->parent == root->parent) {
-            root = v;
-        } else if (u == u->parent->left) {
-            u->parent->left = v;
-        } else {
-            u->parent->right = v;
-        }
-        v->parent = u->parent;
+    Value * operator->() const {
+        return &**this;
     }
 
-    void fixup_erase(node_base<T> * x) {
-        while (x != root && x->color == black) {
-            if (x == x->parent->left) {
-                auto w = x->parent->right;
-                if (w->color == red) {
-                    w->color = black;
-                    x->parent->color = red;
-                    left_rotate(x->parent);
-                    w = x->parent->right;
-                }
-                if (w->left->color == black &&
-                    w->right->color == black) {
-                    w->color = red;
-                    x = x->parent;
-                } else {
-                    if (w->right->color == black) {
-                        w->left->color = red;
-                        right_rotate(w);
-                        w = x->parent->right;
-                    }
-                    w->color = x->parent->color;
-                    x->parent->color = black;
-                    w->right->color = black;
-                    left_rotate(x->parent);
-                    x = root;
-                }
-            } else {
-                auto w = x->parent->left;
-                if (w->color == red) {
-                    w->color = black;
-                    x->parent->color = red;
-                    right_rotate(x->parent);
-                    w = x->parent->left;
-                }
-                if (w->right->color == black &&
-                    w->left->color == black) {
-                    w->color = red;
-                    x = x->parent;
-                } else {
-                    if (w->left->color == black) {
-                        w->right->color = red;
-                        left_rotate(w);
-                        w = x->parent->left;
-                    }
-                    w->color = x->parent->color;
-                    x->parent->color = black;
-                    w->left->color = black;
-                    right_rotate(x->parent);
-                    x = root;
-                }
-            }
-        }
-        x->color = black;
+    friend bool operator==(const rb_tree_value_iterator & lhs,
+                           const rb_tree_value_iterator & rhs) {
+        return lhs.it == rhs.it;
     }
 
-    void erase(node_base<T> * z) {
-        node_base<T> * y = z;
-        node_color y_original_color = y->color;
-        node_base<T> * x;
-        if (z->left == root->parent) {
-            x = z->right;
-            transplant(z, z->right);
-        } else if (z->right == root->parent) {
-            x = z->left;
-            transplant(z, z->left);
-        } else {
-            y = minimum(z->right);
-            y_original_color = y->color;
-            x = y->right;
-            if (y->parent == z) {
-                x->parent = y;
-            } else {
-                transplant(y, y->right);
-                y->right = z->right;
-                y->right->parent = y;
-            }
-            transplant(z, y);
-            y->left = z->left;
-            y->left->parent = y;
-            y->color = z->color;
-        }
-        if (z == root->parent->left) {
-            root->parent->left = z->parent;
-        }
-        if (z == root->parent->right) {
-            root->parent->right = z->parent;
-        }
-        delete z;
-        if (y_original_color == black) {
-            fixup_erase(x);
-        }
+    friend bool operator!=(const rb_tree_value_iterator & lhs,
+                           const rb_tree_value_iterator & rhs) {
+        return lhs.it != rhs.it;
     }
 
+};
+
+// Two iterators of a tree as a range, with reverse iteration.
+template <typename Iterator>
+class rb_tree_range {
+    Iterator first;
+    Iterator last;
+
 public:
 
-    rb_tree()
-            : root(new node_base<T>()) { }
+    using reverse_iterator = std::reverse_iterator<Iterator>;
 
-    rb_tree(const rb_tree & other)
-            : root(new node_base<T>()) {
-        auto nil = root;
-        try {
-            root = copy(other.root->parent, other.root);
-        } catch (...) {
-            delete root;
-            throw;
-        }
-        root->parent = nil;
-        auto leftmost = root;
-        while (leftmost->left != nil) { leftmost = leftmost->left; }
-        nil->left = leftmost;
-        auto rightmost = root;
-        while (rightmost->right != nil) { rightmost = rightmost->right; }
-        nil->right = rightmost;
+    rb_tree_range(Iterator first, Iterator last)
+            : first(first)
+            , last(last) { }
+
+    Iterator begin() const {
+        return first;
     }
 
-    rb_tree(rb_tree && other)
-            : root() {
-        auto holder = std::unique_ptr<node_base<T>>(other.root);
-        other.root = new node_base<T>();
-        root = holder.release();
+    Iterator end() const {
+        return last;
     }
 
-    ~rb_tree() {
-        auto nil = root->parent;
-        free_nodes(root);
-        delete nil;
+    reverse_iterator rbegin() const {
+        return reverse_iterator(last);
     }
 
-    const node_base<T> * minimum(const node_base<T> * x) const {
-        while (x->left != root->parent) {
-            x = x->left;
-        }
-        return x;
+    reverse_iterator rend() const {
+        return reverse_iterator(first);
     }
 
-    node_base<T> * minimum(node_base<T> * x) const {
-        while (x->left != root->parent) {
-            x = x->left;
-        }
-        return x;
+};
+
+// Owns a node that has been extracted from a tree, so it can be inserted
+// into another tree with an equal allocator without reallocating it.
+template <typename T, typename NodeAllocator>
+class rb_node_handle {
+    template <typename, typename, typename, typename, typename, bool,
+              typename, bool>
+    friend class basic_rb_tree;
+
+    using alloc_traits = std::allocator_traits<NodeAllocator>;
+    using tree_node = typename alloc_traits::value_type;
+
+    tree_node * node;
+    std::optional<NodeAllocator> alloc;
+
+    rb_node_handle(tree_node * node, const NodeAllocator & alloc)
+            : node(node)
+            , alloc(alloc) { }
+
+    tree_node * release() {
+        auto z = node;
+        node = nullptr;
+        alloc.reset();
+        return z;
     }
 
-    const node_base<T> * insert(const T & value) {
-        auto z = std::make_unique<node_with_value<T>>(value);
-        if (insert(z.get())) {
-            return z.release();
-        } else {
-            return nullptr;
-        }
+    void reset() {
+        if (!node) return;
+        alloc_traits::destroy(*alloc, node);
+        alloc_traits::deallocate(*alloc, node, 1);
+        node = nullptr;
+        alloc.reset();
     }
 
-    bool contains(const T & value) const {
-        const node_base<T> * z = root;
-        while (z != root->parent) {
-            if (value < z->get_value()) {
-                z = z->left;
-            } else if (value > z->get_value()) {
-                z = z->right;
-            } else {
-                return true;
-            }
+public:
+
+    using value_type = T;
+    using allocator_type = NodeAllocator;
+
+    rb_node_handle()
+            : node(nullptr) { }
+
+    rb_node_handle(rb_node_handle && other)
+            : node(other.node)
+            , alloc(std::move(other.alloc)) {
+        other.node = nullptr;
+        other.alloc.reset();
+    }
+
+    rb_node_handle & operator=(rb_node_handle && other) {
+        if (this != &other) {
+            reset();
+            node = other.node;
+            alloc = std::move(other.alloc);
+            other.node = nullptr;
+            other.alloc.reset();
         }
-        return false;
+        return *this;
     }
 
-    void erase(const T & value) {
-        erase(find(value));
+    ~rb_node_handle() {
+        reset();
     }
 
-    void erase(const node_base<T> * node) {
-        erase(const_cast<node_base<T> *>(node));
+    bool empty() const {
+        return node == nullptr;
     }
 
-    const node_base<T> * find(const T & value) const {
-        auto x = root;
-        while (x != root->parent) {
-            if (value < x->get_value()) {
-                x = x->left;
-            } else {
-                x = x->right;
-            }
-        }
-        return x == root->parent ? nullptr : x;
+    explicit operator bool() const {
+        return node != nullptr;
     }
 
-    void print_by_level(std::ostream & os) const {
-        if (!root) os << "<empty>" << std::endl;
-        std::stack<std::pair<node_base<T> *, unsigned>> nodes;
-        auto cur_node = root;
-        auto depth = 1u;
-        while (true) {
-            if (root->parent != cur_node) {
-                nodes.push({ cur_node, depth });
-                cur_node = cur_node->right;
-                depth += 6;
-            } else if (!nodes.empty()) {
-                cur_node = nodes.top().first;
+    T & value() const {
+        return node->value;
+    }
+
+    allocator_type get_allocator() const {
+        return *alloc;
+    }
+
+};
+
+// What a tree has been doing, counted when RB_TREE_STATS is defined (in
+// every translation unit) and compiled away otherwise; see stats().
+struct rb_tree_stats {
+    std::uint64_t left_rotations = 0;
+    std::uint64_t right_rotations = 0;
+    // fixup_insert steps: red uncle, so only recolored; black uncle,
+    // rotated once (outer child) or twice (inner child)
+    std::uint64_t insert_recolors = 0;
+    std::uint64_t insert_single_rotations = 0;
+    std::uint64_t insert_double_rotations = 0;
+    // fixup_erase steps, cases 1 to 4 of CLRS: red sibling; black
+    // sibling with black children, recolored; black sibling with only
+    // its near child red; black sibling with its far child red
+    std::uint64_t erase_red_siblings = 0;
+    std::uint64_t erase_recolors = 0;
+    std::uint64_t erase_near_children = 0;
+    std::uint64_t erase_far_children = 0;
+    // Descents of single lookups and insertions, the comparisons they
+    // made and how many have visited d nodes; the last bucket also
+    // counts deeper ones.
+    static constexpr std::size_t max_depth = 128;
+    std::uint64_t descents = 0;
+    std::uint64_t comparisons = 0;
+    std::uint64_t depth_histogram[max_depth + 1] = {};
+    // of the tree stats() was called on
+    std::size_t size = 0;
+    unsigned black_height = 0;
+};
+
+#ifdef RB_TREE_STATS
+constexpr bool rb_tree_stats_enabled = true;
+#else
+constexpr bool rb_tree_stats_enabled = false;
+#endif
+
+// The counters a tree keeps for stats(). Lookups count too, and they may
+// run on several threads at once, as may the halves of a parallel set
+// operation, so the counters are mutable and bumped with relaxed atomic
+// adds. A copy starts from zero.
+template <bool Enabled = rb_tree_stats_enabled>
+class rb_tree_counters {
+    mutable rb_tree_stats counts;
+
+    static void add(std::uint64_t & counter, std::uint64_t n) {
+        __atomic_fetch_add(&counter, n, __ATOMIC_RELAXED);
+    }
+
+    static std::uint64_t load(const std::uint64_t & counter) {
+        return __atomic_load_n(&counter, __ATOMIC_RELAXED);
+    }
+
+public:
+
+    rb_tree_counters() = default;
+
+    rb_tree_counters(const rb_tree_counters &) { }
+
+    rb_tree_counters & operator=(const rb_tree_counters &) {
+        return *this;
+    }
+
+    void count(std::uint64_t rb_tree_stats::* counter) const {
+        add(counts.*counter, 1);
+    }
+
+    void descent(unsigned depth, unsigned comparisons) const {
+        add(counts.descents, 1);
+        add(counts.comparisons, comparisons);
+        add(counts.depth_histogram[std::min<std::size_t>(
+            depth, rb_tree_stats::max_depth)], 1);
+    }
+
+    rb_tree_stats snapshot() const {
+        static constexpr std::uint64_t rb_tree_stats::* counters[] = {
+            &rb_tree_stats::left_rotations,
+            &rb_tree_stats::right_rotations,
+            &rb_tree_stats::insert_recolors,
+            &rb_tree_stats::insert_single_rotations,
+            &rb_tree_stats::insert_double_rotations,
+            &rb_tree_stats::erase_red_siblings,
+            &rb_tree_stats::erase_recolors,
+            &rb_tree_stats::erase_near_children,
+            &rb_tree_stats::erase_far_children,
+            &rb_tree_stats::descents,
+            &rb_tree_stats::comparisons,
+        };
+        rb_tree_stats result;
+        for (auto counter : counters) result.*counter = load(counts.*counter);
+        for (std::size_t d = 0; d <= rb_tree_stats::max_depth; ++d) {
+            result.depth_histogram[d] = load(counts.depth_histogram[d]);
+        }
+        return result;
+    }
+
+    void reset() {
+        counts = rb_tree_stats();
+    }
+};
+
+// Without RB_TREE_STATS: empty, so it takes no room in the tree, and
+// every update is a no-op.
+template <>
+class rb_tree_counters<false> {
+public:
+
+    void count(std::uint64_t rb_tree_stats::*) const { }
+
+    void descent(unsigned, unsigned) const { }
+
+    rb_tree_stats snapshot() const {
+        return rb_tree_stats();
+    }
+
+    void reset() { }
+};
+
+// Selects the constructor that builds a tree from already sorted input.
+struct sorted_tag { };
+
+// Holds a possibly stateless member without spending storage on it.
+template <typename T, int Tag,
+          bool = std::is_class<T>::value && !std::is_final<T>::value>
+struct ebo_storage : private T {
+    ebo_storage(const T & value) : T(value) { }
+    T & get() { return *this; }
+    const T & get() const { return *this; }
+};
+
+template <typename T, int Tag>
+struct ebo_storage<T, Tag, false> {
+    T value;
+    ebo_storage(const T & value) : value(value) { }
+    T & get() { return value; }
+    const T & get() const { return value; }
+};
+
+template <typename Compare, typename K, typename = void>
+struct is_transparent_compare : std::false_type { };
+
+template <typename Compare, typename K>
+struct is_transparent_compare<Compare, K,
+        std::void_t<typename Compare::is_transparent>>
+        : std::true_type { };
+
+struct identity_key {
+    template <typename T>
+    const T & operator()(const T & value) const {
+        return value;
+    }
+};
+
+struct pair_first_key {
+    template <typename Pair>
+    const typename Pair::first_type & operator()(const Pair & value) const {
+        return value.first;
+    }
+};
+
+template <typename T, typename Augment>
+struct augment_traits {
+    using node = augmented_node<T, typename Augment::metadata>;
+};
+
+template <typename T>
+struct augment_traits<T, no_augment> {
+    using node = node_with_value<T>;
+};
+
+// Red-black tree core shared by the set and map front ends. Elements of
+// type T are ordered by Compare applied to KeyOfValue()(element); with
+// Multi set, equal keys are kept in insertion order. Augment selects the
+// per-node metadata kept up to date through every structural change.
+template <typename Key,
+          typename T,
+          typename KeyOfValue,
+          typename Compare,
+          typename Allocator,
+          bool Multi,
+          typename Augment = no_augment,
+          bool Linked = false>
+class basic_rb_tree
+        : private ebo_storage<Compare, 0>
+        , private ebo_storage<typename std::allocator_traits<Allocator>::
+              template rebind_alloc<typename std::conditional<Linked,
+                  linked_node<T>,
+                  typename augment_traits<T, Augment>::node>::type>, 1>
+        , private ebo_storage<rb_tree_counters<>, 2> {
+    using tree_node = typename std::conditional<Linked, linked_node<T>,
+        typename augment_traits<T, Augment>::node>::type;
+    using node_allocator = typename std::allocator_traits<Allocator>::
+        template rebind_alloc<tree_node>;
+    using node_alloc_traits = std::allocator_traits<node_allocator>;
+    using compare_holder = ebo_storage<Compare, 0>;
+    using allocator_holder = ebo_storage<node_allocator, 1>;
+    // qualified: the injected name of the private base is inaccessible
+    using stats_counters = ::rb_tree_counters<>;
+    using counters_holder = ebo_storage<stats_counters, 2>;
+
+    static constexpr bool augmented =
+        !std::is_same<Augment, no_augment>::value;
+
+    static_assert(!Linked || !augmented,
+                  "linked trees cannot be augmented");
+
+    // Enables the heterogeneous overloads of the lookup functions.
+    template <typename K>
+    using transparent_key = typename std::enable_if<
+        is_transparent_compare<Compare, K>::value>::type;
+
+    // Leaves and the root's parent are node_base<T>::sentinel; header's
+    // left and right point to the first and last nodes (to the sentinel
+    // when the tree is empty).
+    node_base<T> * root;
+    std::size_t node_count;
+    node_base<T> header;
+
+public:
+
+    using key_type = Key;
+    using value_type = T;
+    using key_compare = Compare;
+    using node_type = rb_node_handle<T, node_allocator>;
+    using node_iterator = const_rb_tree_iterator<T, Linked>;
+
+    // Over values rather than nodes; see nodes(). Values that hold the
+    // key or feed the augmentation are read-only.
+    using iterator = rb_tree_value_iterator<T, typename std::conditional<
+        std::is_same<Key, T>::value || augmented, const T, T>::type, Linked>;
+    using const_iterator = rb_tree_value_iterator<T, const T, Linked>;
+    using reverse_iterator = std::reverse_iterator<iterator>;
+    using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+    // What insert and emplace return, as for std::set and std::multiset:
+    // a unique tree also tells whether the value went in.
+    using insert_result = typename std::conditional<
+        Multi, iterator, std::pair<iterator, bool>>::type;
+
+    // Inserting a node handle into a unique tree hands a rejected node
+    // back in node, as std::set does.
+    struct insert_return_type {
+        iterator position;
+        bool inserted;
+        node_type node;
+    };
+
+    using node_insert_result = typename std::conditional<
+        Multi, iterator, insert_return_type>::type;
+
+private:
+
+    const Compare & comp() const {
+        return compare_holder::get();
+    }
+
+    static const Key & key(const node_base<T> * x) {
+        return KeyOfValue()(x->get_value());
+    }
+
+    template <typename Node>
+    static auto & metadata(Node * x) {
+        using node = std::conditional_t<std::is_const<Node>::value,
+                                        const tree_node, tree_node>;
+        return static_cast<node *>(x)->metadata;
+    }
+
+    // Recomputes x's metadata from its element and children.
+    static void update(node_base<T> * x) {
+        if constexpr (augmented) {
+            auto nil = &node_base<T>::sentinel;
+            metadata(x) = Augment::combine(
+                x->get_value(),
+                x->left != nil ? &metadata(x->left) : nullptr,
+                x->right != nil ? &metadata(x->right) : nullptr);
+        }
+    }
+
+    // Recomputes metadata from x up to the root.
+    static void update_path(node_base<T> * x) {
+        if constexpr (augmented) {
+            auto nil = &node_base<T>::sentinel;
+            for (; x != nil; x = x->parent) {
+                update(x);
+            }
+        }
+    }
+
+    // Whether emplace can read the key straight from its arguments, which
+    // lets it look up the position before allocating anything.
+    template <typename... Args>
+    static constexpr bool key_is_known() {
+        using args = std::tuple<std::decay_t<Args>...>;
+        if constexpr (sizeof...(Args) == 1) {
+            return std::is_same<std::tuple_element_t<0, args>, T>::value;
+        } else if constexpr (sizeof...(Args) == 2) {
+            return !std::is_same<Key, T>::value &&
+                   std::is_same<std::tuple_element_t<0, args>, Key>::value;
+        } else {
+            return false;
+        }
+    }
+
+    static const Key & known_key(const T & value) {
+        return KeyOfValue()(value);
+    }
+
+    template <typename Mapped>
+    static const Key & known_key(const Key & k, const Mapped &) {
+        return k;
+    }
+
+    node_allocator & get_node_allocator() {
+        return allocator_holder::get();
+    }
+
+protected:
+
+    template <typename... Args>
+    tree_node * create_node(Args &&... args) {
+        auto & alloc = get_node_allocator();
+        auto z = node_alloc_traits::allocate(alloc, 1);
+        try {
+            node_alloc_traits::construct(alloc, z,
+                                         std::forward<Args>(args)...);
+        } catch (...) {
+            node_alloc_traits::deallocate(alloc, z, 1);
+            throw;
+        }
+        return z;
+    }
+
+    void destroy_node(const node_base<T> * x) {
+        auto & alloc = get_node_allocator();
+        auto z = static_cast<tree_node *>(const_cast<node_base<T> *>(x));
+        node_alloc_traits::destroy(alloc, z);
+        node_alloc_traits::deallocate(alloc, z, 1);
+    }
+
+    // Where a node with a given key goes. For unique trees existing is
+    // the node holding an equal key, if any; parent == nil means the tree
+    // is empty.
+    struct insert_position {
+        node_base<T> * parent;
+        bool left;
+        node_base<T> * existing;
+    };
+
+    node_base<T> * successor(node_base<T> * x) const {
+        auto nil = root->parent;
+        if (x->right != nil) return minimum(x->right);
+        auto y = x->parent;
+        while (y != nil && x == y->right) {
+            x = y;
+            y = y->parent;
+        }
+        return y;
+    }
+
+    node_base<T> * predecessor(node_base<T> * x) const {
+        auto nil = root->parent;
+        if (x->left != nil) return maximum(x->left);
+        auto y = x->parent;
+        while (y != nil && x == y->left) {
+            x = y;
+            y = y->parent;
+        }
+        return y;
+    }
+
+    // Descends from the root, or from a node whose subtree is known to
+    // hold k's position.
+    template <typename K>
+    insert_position find_insert_position(
+            const K & k, node_base<T> * from = nullptr) const {
+        auto nil = root->parent;
+        auto y = nil;
+        auto x = from ? from : root;
+        bool left = true;
+        descent_stats stats(counters());
+        while (x != nil) {
+            y = x;
+            if (comp()(k, key(x))) {
+                stats.visit(1);
+                left = true;
+                x = x->left;
+            } else if (Multi || comp()(key(x), k)) {
+                stats.visit(Multi ? 1 : 2);
+                left = false;
+                x = x->right;
+            } else {
+                stats.visit(2);
+                return { y, left, x };
+            }
+        }
+        return { y, left, nullptr };
+    }
+
+    // Like find_insert_position, but first tries to place k right before
+    // hint. That takes O(1) comparisons when the hint is correct, e.g.
+    // end() for ascending input; a wrong hint costs a full descent.
+    template <typename K>
+    insert_position hinted_insert_position(const node_base<T> * hint,
+                                           const K & k) const {
+        auto nil = root->parent;
+        auto pos = const_cast<node_base<T> *>(hint);
+        if (root == nil) return find_insert_position(k);
+        if (pos == nil) {
+            if (comp()(key(header.right), k) ||
+                (Multi && !comp()(k, key(header.right)))) {
+                return { header.right, false, nullptr };
+            }
+            return find_insert_position(k);
+        }
+        if (!Multi && !comp()(k, key(pos)) && !comp()(key(pos), k)) {
+            return { pos, false, pos };
+        }
+        if (!comp()(key(pos), k)) {
+            // k goes before pos: it must not be less than pos's predecessor
+            if (pos == header.left) return { pos, true, nullptr };
+            auto before = predecessor(pos);
+            if (comp()(key(before), k) ||
+                (Multi && !comp()(k, key(before)))) {
+                if (before->right == nil) return { before, false, nullptr };
+                return { pos, true, nullptr };
+            }
+            return find_insert_position(k);
+        }
+        // k goes after pos: it must be less than pos's successor
+        if (pos == header.right) return { pos, false, nullptr };
+        auto after = successor(pos);
+        if (comp()(k, key(after))) {
+            if (pos->right == nil) return { pos, false, nullptr };
+            return { after, true, nullptr };
+        }
+        return find_insert_position(k);
+    }
+
+    // Links z in at position and rebalances.
+    void attach(node_base<T> * z, const insert_position & position) {
+        auto nil = root->parent;
+        auto y = position.parent;
+        z->parent = y;
+        z->left = nil;
+        z->right = nil;
+        z->color = red;
+        if constexpr (Linked) link_neighbours(z, position);
+        if (y == nil) {
+            root = z;
+            header.left = z;
+            header.right = z;
+        } else if (position.left) {
+            y->left = z;
+            if (y == header.left) header.left = z;
+        } else {
+            y->right = z;
+            if (y == header.right) header.right = z;
+        }
+        ++node_count;
+        update_path(z);
+        fixup_insert(root, z, counters());
+    }
+
+private:
+
+    // Pool allocators can drop all nodes at once when nothing needs to be
+    // destructed and the pool belongs to this tree alone.
+    bool release_all_nodes(std::true_type) {
+        return get_node_allocator().try_release_all();
+    }
+
+    bool release_all_nodes(std::false_type) {
+        return false;
+    }
+
+    // Frees the subtree of x in O(n) time and constant space, whatever
+    // its shape: left children are rotated up until the node at hand has
+    // none, so it can go and its right child takes its place, as in
+    // detach_nodes. Parent pointers are left stale.
+    void free_nodes(const node_base<T> * nil, node_base<T> * x) {
+        while (x != nil) {
+            if (x->left != nil) {
+                auto y = x->left;
+                x->left = y->right;
+                y->right = x;
+                x = y;
+            } else {
+                auto next = x->right;
+                destroy_node(x);
+                x = next;
+            }
+        }
+    }
+
+    // Whether all nodes can go at once; see release_all_nodes. The whole
+    // node must be trivially destructible, metadata included.
+    using bulk_release = std::integral_constant<bool,
+        std::is_trivially_destructible<tree_node>::value &&
+        has_bulk_release<node_allocator>::value>;
+
+    // Flattens the tree into a list linked through parent pointers by
+    // rotating left children up, in O(n) time and without a stack. The
+    // tree is left empty.
+    node_base<T> * detach_nodes() {
+        auto nil = root->parent;
+        node_base<T> * list = nullptr;
+        auto x = root;
+        while (x != nil) {
+            if (x->left != nil) {
+                auto y = x->left;
+                x->left = y->right;
+                y->right = x;
+                x = y;
+            } else {
+                auto next = x->right;
+                x->parent = list;
+                list = x;
+                x = next;
+            }
+        }
+        root = nil;
+        node_count = 0;
+        reset_header();
+        return list;
+    }
+
+    // Hands out nodes of a detached tree for reuse, then frees the rest.
+    class node_recycler {
+        basic_rb_tree & tree;
+        node_base<T> * list;
+
+    public:
+
+        node_recycler(basic_rb_tree & tree)
+                : tree(tree)
+                , list(tree.detach_nodes()) { }
+
+        node_recycler(const node_recycler &) = delete;
+
+        ~node_recycler() {
+            while (list) {
+                auto next = list->parent;
+                tree.destroy_node(list);
+                list = next;
+            }
+        }
+
+        template <typename Arg>
+        tree_node * operator()(Arg && value) {
+            if (!list) return tree.create_node(std::forward<Arg>(value));
+            auto z = static_cast<tree_node *>(list);
+            list = list->parent;
+            auto & alloc = tree.get_node_allocator();
+            node_alloc_traits::destroy(alloc, z);
+            try {
+                node_alloc_traits::construct(alloc, z, std::in_place,
+                                             std::forward<Arg>(value));
+            } catch (...) {
+                node_alloc_traits::deallocate(alloc, z, 1);
+                throw;
+            }
+            return z;
+        }
+    };
+
+    struct node_creator {
+        basic_rb_tree & tree;
+
+        template <typename Arg>
+        tree_node * operator()(Arg && value) {
+            return tree.create_node(std::forward<Arg>(value));
+        }
+    };
+
+    // Clones one node of other's tree: value and color, unlinked.
+    template <typename NodeGen>
+    node_base<T> * clone_node(const node_base<T> * x, NodeGen & gen) {
+        node_base<T> * z = gen(x->get_value());
+        auto nil = root->parent;
+        z->parent = nil;
+        z->left = nil;
+        z->right = nil;
+        z->color = x->color;
+        if constexpr (augmented) metadata(z) = metadata(x);
+        return z;
+    }
+
+    template <typename NodeGen>
+    node_base<T> * clone_node(node_base<T> * x, NodeGen & gen) {
+        node_base<T> * z = gen(std::move(x->get_value()));
+        auto nil = root->parent;
+        z->parent = nil;
+        z->left = nil;
+        z->right = nil;
+        z->color = x->color;
+        if constexpr (augmented) metadata(z) = metadata(x);
+        return z;
+    }
+
+    // Copies the subtree at x into this tree's sentinel with the same
+    // shape and colors, so no rebalancing is needed. Walks the source via
+    // parent pointers, so tree depth never turns into stack depth.
+    template <typename Node, typename NodeGen>
+    node_base<T> * clone_tree(Node * other_nil, Node * x, NodeGen & gen) {
+        auto nil = root->parent;
+        auto top = clone_node(x, gen);
+        auto z = top;
+        try {
+            while (true) {
+                if (x->left != other_nil && z->left == nil) {
+                    x = x->left;
+                    auto y = clone_node(x, gen);
+                    z->left = y;
+                    y->parent = z;
+                    z = y;
+                } else if (x->right != other_nil && z->right == nil) {
+                    x = x->right;
+                    auto y = clone_node(x, gen);
+                    z->right = y;
+                    y->parent = z;
+                    z = y;
+                } else if (z != top) {
+                    x = x->parent;
+                    z = z->parent;
+                } else {
+                    break;
+                }
+            }
+        } catch (...) {
+            free_nodes(nil, top);
+            throw;
+        }
+        return top;
+    }
+
+    // Replaces the (empty) contents with a copy of other's tree, moving
+    // the values out of it when Node is not const.
+    template <typename Node, typename NodeGen>
+    void assign_tree(Node * other_root, std::size_t other_count,
+                     NodeGen & gen) {
+        auto nil = root->parent;
+        Node * other_nil = other_root->parent;
+        if (other_root == other_nil) return;
+        root = clone_tree(other_nil, other_root, gen);
+        node_count = other_count;
+        root->parent = nil;
+        reset_links();
+    }
+
+    void reserve_nodes(const basic_rb_tree & other) {
+        if constexpr (has_node_reserve<node_allocator>::value) {
+            get_node_allocator().reserve(other.node_count);
+        }
+    }
+
+    void destroy_all_nodes() {
+        auto nil = root->parent;
+        if (!release_all_nodes(bulk_release())) free_nodes(nil, root);
+        root = nil;
+        node_count = 0;
+        reset_header();
+    }
+
+    // Points the header at the first and last nodes.
+    void reset_header() {
+        header.left = minimum(root);
+        header.right = maximum(root);
+    }
+
+    // Points the header at the first and last nodes and, in a linked
+    // tree, chains every node to its neighbours in O(n). For trees built
+    // in bulk; join, split and the set operations splice instead.
+    void reset_links() {
+        reset_header();
+        if constexpr (Linked) link_all();
+    }
+
+    static linked_node<T> * links(node_base<T> * x) {
+        return static_cast<linked_node<T> *>(x);
+    }
+
+    // Puts z, about to be attached at position, between its neighbours:
+    // its parent-to-be and the node on the parent's other side.
+    void link_neighbours(node_base<T> * z, const insert_position & position) {
+        auto nil = root->parent;
+        auto y = position.parent;
+        node_base<T> * prev = nil;
+        node_base<T> * next = nil;
+        if (y != nil && position.left) {
+            prev = links(y)->prev;
+            next = y;
+        } else if (y != nil) {
+            prev = y;
+            next = links(y)->next;
+        }
+        links(z)->prev = prev;
+        links(z)->next = next;
+        if (prev != nil) links(prev)->next = z;
+        if (next != nil) links(next)->prev = z;
+    }
+
+    void unlink_neighbours(node_base<T> * z) {
+        auto nil = root->parent;
+        auto prev = links(z)->prev;
+        auto next = links(z)->next;
+        if (prev != nil) links(prev)->next = next;
+        if (next != nil) links(next)->prev = prev;
+    }
+
+    // Chains x before y, either of which may be the sentinel.
+    void link_pair(node_base<T> * x, node_base<T> * y) {
+        auto nil = root->parent;
+        if (x != nil) links(x)->next = y;
+        if (y != nil) links(y)->prev = x;
+    }
+
+    void link_all() {
+        auto nil = root->parent;
+        node_base<T> * prev = nil;
+        for (auto x = header.left; x != nil; x = successor(x)) {
+            links(x)->prev = prev;
+            if (prev != nil) links(prev)->next = x;
+            prev = x;
+        }
+        if (prev != nil) links(prev)->next = nil;
+    }
+
+    void swap_nodes(basic_rb_tree & other) {
+        std::swap(root, other.root);
+        std::swap(node_count, other.node_count);
+        std::swap(header.left, other.header.left);
+        std::swap(header.right, other.header.right);
+    }
+
+    const stats_counters & counters() const {
+        return counters_holder::get();
+    }
+
+    // Tallies one descent into the tree's counters when it ends; does
+    // nothing, and is optimized out, unless stats are enabled.
+    struct descent_stats {
+        const stats_counters & counters;
+        unsigned depth = 0;
+        unsigned comparisons = 0;
+
+        explicit descent_stats(const stats_counters & counters)
+                : counters(counters) { }
+
+        void visit(unsigned compared) {
+            if constexpr (rb_tree_stats_enabled) {
+                ++depth;
+                comparisons += compared;
+            }
+        }
+
+        ~descent_stats() {
+            counters.descent(depth, comparisons);
+        }
+    };
+
+    static void left_rotate(node_base<T> *& root, node_base<T> * x,
+                            const stats_counters & counters) {
+        counters.count(&rb_tree_stats::left_rotations);
+        auto nil = &node_base<T>::sentinel;
+        auto y = x->right;
+        x->right = y->left;
+        if (y->left != nil) {
+            y->left->parent = x;
+        }
+        y->parent = x->parent;
+        if (x->parent == nil) {
+            root = y;
+        } else if (x == x->parent->left) {
+            x->parent->left = y;
+        } else {
+            x->parent->right = y;
+        }
+        y->left = x;
+        x->parent = y;
+        update(x);
+        update(y);
+    }
+
+    static void right_rotate(node_base<T> *& root, node_base<T> * x,
+                             const stats_counters & counters) {
+        counters.count(&rb_tree_stats::right_rotations);
+        auto nil = &node_base<T>::sentinel;
+        auto y = x->left;
+        x->left = y->right;
+        if (y->right != nil) {
+            y->right->parent = x;
+        }
+        y->parent = x->parent;
+        if (x->parent == nil) {
+            root = y;
+        } else if (x == x->parent->right) {
+            x->parent->right = y;
+        } else {
+            x->parent->left = y;
+        }
+        y->right = x;
+        x->parent = y;
+        update(x);
+        update(y);
+    }
+
+    // Rebalances after red z was linked into the tree rooted at root.
+    // Returns whether the root had to be blackened, i.e. whether the
+    // black height of the tree grew.
+    static bool fixup_insert(node_base<T> *& root, node_base<T> * z,
+                             const stats_counters & counters) {
+        while (z->parent->color == red) {
+            if (z->parent == z->parent->parent->left) {
+                auto y = z->parent->parent->right;
+                if (y->color == red) {
+                    counters.count(&rb_tree_stats::insert_recolors);
+                    z->parent->color = black;
+                    y->color = black;
+                    z->parent->parent->color = red;
+                    z = z->parent->parent;
+                } else {
+                    if (z == z->parent->right) {
+                        counters.count(&rb_tree_stats::insert_double_rotations);
+                        z = z->parent;
+                        left_rotate(root, z, counters);
+                    } else {
+                        counters.count(&rb_tree_stats::insert_single_rotations);
+                    }
+                    z->parent->color = black;
+                    z->parent->parent->color = red;
+                    right_rotate(root, z->parent->parent, counters);
+                }
+            } else {
+                auto y = z->parent->parent->left;
+                if (y->color == red) {
+                    counters.count(&rb_tree_stats::insert_recolors);
+                    z->parent->color = black;
+                    y->color = black;
+                    z->parent->parent->color = red;
+                    z = z->parent->parent;
+                } else {
+                    if (z == z->parent->left) {
+                        counters.count(&rb_tree_stats::insert_double_rotations);
+                        z = z->parent;
+                        right_rotate(root, z, counters);
+                    } else {
+                        counters.count(&rb_tree_stats::insert_single_rotations);
+                    }
+                    z->parent->color = black;
+                    z->parent->parent->color = red;
+                    left_rotate(root, z->parent->parent, counters);
+                }
+            }
+        }
+        bool grew = root->color == red;
+        root->color = black;
+        return grew;
+    }
+
+    void transplant(node_base<T> * u, node_base<T> * v) {
+        if (u->parent == root->parent) {
+            root = v;
+        } else if (u == u->parent->left) {
+            u->parent->left = v;
+        } else {
+            u->parent->right = v;
+        }
+        if (v != root->parent) v->parent = u->parent;
+    }
+
+    // x may be the sentinel, which is never written to, so its parent is
+    // passed along separately.
+    void fixup_erase(node_base<T> * x, node_base<T> * x_parent) {
+        while (x != root && x->color == black) {
+            if (x == x_parent->left) {
+                auto w = x_parent->right;
+                if (w->color == red) {
+                    counters().count(&rb_tree_stats::erase_red_siblings);
+                    w->color = black;
+                    x_parent->color = red;
+                    left_rotate(root, x_parent, counters());
+                    w = x_parent->right;
+                }
+                if (w->left->color == black &&
+                    w->right->color == black) {
+                    counters().count(&rb_tree_stats::erase_recolors);
+                    w->color = red;
+                    x = x_parent;
+                    x_parent = x->parent;
+                } else {
+                    if (w->right->color == black) {
+                        counters().count(&rb_tree_stats::erase_near_children);
+                        w->left->color = red;
+                        right_rotate(root, w, counters());
+                        w = x_parent->right;
+                    }
+                    counters().count(&rb_tree_stats::erase_far_children);
+                    w->color = x_parent->color;
+                    x_parent->color = black;
+                    w->right->color = black;
+                    left_rotate(root, x_parent, counters());
+                    x = root;
+                }
+            } else {
+                auto w = x_parent->left;
+                if (w->color == red) {
+                    counters().count(&rb_tree_stats::erase_red_siblings);
+                    w->color = black;
+                    x_parent->color = red;
+                    right_rotate(root, x_parent, counters());
+                    w = x_parent->left;
+                }
+                if (w->right->color == black &&
+                    w->left->color == black) {
+                    counters().count(&rb_tree_stats::erase_recolors);
+                    w->color = red;
+                    x = x_parent;
+                    x_parent = x->parent;
+                } else {
+                    if (w->left->color == black) {
+                        counters().count(&rb_tree_stats::erase_near_children);
+                        w->right->color = red;
+                        left_rotate(root, w, counters());
+                        w = x_parent->left;
+                    }
+                    counters().count(&rb_tree_stats::erase_far_children);
+                    w->color = x_parent->color;
+                    x_parent->color = black;
+                    w->left->color = black;
+                    right_rotate(root, x_parent, counters());
+                    x = root;
+                }
+            }
+        }
+        if (x != root->parent) x->color = black;
+    }
+
+    // Removes z from the tree without destroying it.
+    void unlink(node_base<T> * z) {
+        auto nil = root->parent;
+        if constexpr (Linked) unlink_neighbours(z);
+        if (z == header.left) {
+            header.left = z->right != nil ? minimum(z->right) : z->parent;
+        }
+        if (z == header.right) {
+            header.right = z->left != nil ? maximum(z->left) : z->parent;
+        }
+        node_base<T> * y = z;
+        node_color y_original_color = y->color;
+        node_base<T> * x;
+        node_base<T> * x_parent;
+        if (z->left == nil) {
+            x = z->right;
+            x_parent = z->parent;
+            transplant(z, z->right);
+        } else if (z->right == nil) {
+            x = z->left;
+            x_parent = z->parent;
+            transplant(z, z->left);
+        } else {
+            y = minimum(z->right);
+            y_original_color = y->color;
+            x = y->right;
+            if (y->parent == z) {
+                x_parent = y;
+            } else {
+                x_parent = y->parent;
+                transplant(y, y->right);
+                y->right = z->right;
+                y->right->parent = y;
+            }
+            transplant(z, y);
+            y->left = z->left;
+            y->left->parent = y;
+            y->color = z->color;
+        }
+        --node_count;
+        update_path(x_parent);
+        if (y_original_color == black) {
+            fixup_erase(x, x_parent);
+        }
+    }
+
+    void erase(node_base<T> * z) {
+        unlink(z);
+        destroy_node(z);
+    }
+
+    template <typename K>
+    insert_position position_near(const node_base<T> * hint,
+                                  const K & k) const {
+        return hint ? hinted_insert_position(hint, k)
+                    : find_insert_position(k);
+    }
+
+    // The new node and true, or the node whose equal key kept the value
+    // out of a unique tree and false.
+    template <typename... Args>
+    std::pair<node_base<T> *, bool> emplace_near(const node_base<T> * hint,
+                                                 Args &&... args) {
+        if constexpr (key_is_known<Args...>()) {
+            auto position = position_near(hint, known_key(args...));
+            if (position.existing) return { position.existing, false };
+            auto z = create_node(std::in_place, std::forward<Args>(args)...);
+            attach(z, position);
+            return { z, true };
+        } else {
+            auto z = create_node(std::in_place, std::forward<Args>(args)...);
+            insert_position position;
+            try {
+                position = position_near(hint, key(z));
+            } catch (...) {
+                destroy_node(z);
+                throw;
+            }
+            if (position.existing) {
+                destroy_node(z);
+                return { position.existing, false };
+            }
+            attach(z, position);
+            return { z, true };
+        }
+    }
+
+    insert_result make_insert_result(std::pair<node_base<T> *, bool> r) {
+        if constexpr (Multi) {
+            return iterator_to(r.first);
+        } else {
+            return { iterator_to(r.first), r.second };
+        }
+    }
+
+    // Builds a perfectly balanced subtree from the next n elements. Nodes
+    // on red_depth, the deepest level, are red and all others black, so
+    // every path has the same black height and no fixup is needed.
+    template <typename ForwardIt>
+    node_base<T> * build_sorted(ForwardIt & first, std::size_t n,
+                                unsigned depth, unsigned red_depth) {
+        auto nil = root->parent;
+        if (n == 0) return nil;
+        auto left_size = (n - 1) / 2;
+        auto left = build_sorted(first, left_size, depth + 1, red_depth);
+        node_base<T> * z;
+        try {
+            z = create_node(*first);
+        } catch (...) {
+            free_nodes(nil, left);
+            throw;
+        }
+        ++first;
+        z->color = depth == red_depth ? red : black;
+        z->left = left;
+        z->right = nil;
+        if (left != nil) left->parent = z;
+        try {
+            z->right = build_sorted(first, n - 1 - left_size,
+                                    depth + 1, red_depth);
+        } catch (...) {
+            free_nodes(nil, z);
+            throw;
+        }
+        if (z->right != nil) z->right->parent = z;
+        update(z);
+        return z;
+    }
+
+    // Links n sorted, unlinked nodes into the same shape and colors as
+    // build_sorted, forking on large halves.
+    template <typename Executor>
+    static node_base<T> * link_sorted(Executor & executor,
+                                      tree_node * const * nodes,
+                                      std::size_t n, unsigned depth,
+                                      unsigned red_depth) {
+        auto nil = &node_base<T>::sentinel;
+        if (n == 0) return nil;
+        auto left_size = (n - 1) / 2;
+        node_base<T> * z = nodes[left_size];
+        node_base<T> * left;
+        node_base<T> * right;
+        auto link_left = [&] {
+            left = link_sorted(executor, nodes, left_size,
+                               depth + 1, red_depth);
+        };
+        auto link_right = [&] {
+            right = link_sorted(executor, nodes + left_size + 1,
+                                n - 1 - left_size, depth + 1, red_depth);
+        };
+        if (n <= executor.grain_size()) {
+            link_left();
+            link_right();
+        } else {
+            executor.fork_join(link_left, link_right);
+        }
+        z->color = depth == red_depth ? red : black;
+        z->parent = nil;
+        z->left = left;
+        z->right = right;
+        if (left != nil) left->parent = z;
+        if (right != nil) right->parent = z;
+        update(z);
+        return z;
+    }
+
+    // Gives nodes[i] the value first[i]. Allocation stays on this thread;
+    // the constructors run on the executor when they cannot throw.
+    template <typename RandomIt, typename Executor>
+    void create_nodes(RandomIt first, std::vector<tree_node *> & nodes,
+                      std::size_t n, Executor & executor) {
+        auto & alloc = get_node_allocator();
+        if constexpr (std::is_nothrow_constructible<
+                          T, decltype(*first)>::value) {
+            try {
+                while (nodes.size() < n) {
+                    nodes.push_back(node_alloc_traits::allocate(alloc, 1));
+                }
+            } catch (...) {
+                for (auto z : nodes) {
+                    node_alloc_traits::deallocate(alloc, z, 1);
+                }
+                throw;
+            }
+            auto construct = [&](std::size_t begin, std::size_t end) {
+                for (auto i = begin; i < end; ++i) {
+                    node_alloc_traits::construct(alloc, nodes[i],
+                                                 std::in_place, first[i]);
+                }
+            };
+            parallel_for(executor, 0, n, construct);
+        } else {
+            try {
+                for (std::size_t i = 0; i < n; ++i) {
+                    nodes.push_back(create_node(std::in_place, first[i]));
+                }
+            } catch (...) {
+                for (auto z : nodes) destroy_node(z);
+                throw;
+            }
+        }
+    }
+
+    template <typename K>
+    std::size_t rank_key(const K & k) const {
+        static_assert(std::is_same<Augment, subtree_size>::value,
+                      "rank() needs subtree_size augmentation");
+        auto nil = root->parent;
+        const node_base<T> * x = root;
+        std::size_t result = 0;
+        while (x != nil) {
+            if (comp()(key(x), k)) {
+                result += 1 + (x->left != nil ? metadata(x->left) : 0);
+                x = x->right;
+            } else {
+                x = x->left;
+            }
+        }
+        return result;
+    }
+
+    template <typename K>
+    bool contains_key(const K & k) const {
+        const node_base<T> * z = root;
+        descent_stats stats(counters());
+        while (z != root->parent) {
+            if (comp()(k, key(z))) {
+                stats.visit(1);
+                z = z->left;
+            } else if (comp()(key(z), k)) {
+                stats.visit(2);
+                z = z->right;
+            } else {
+                stats.visit(2);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // First element with key equal to k, or nullptr.
+    template <typename K>
+    const node_base<T> * find_key(const K & k) const {
+        auto x = lower_bound_node(k);
+        if (x == root->parent || comp()(k, key(x))) return nullptr;
+        return x;
+    }
+
+    template <typename K>
+    const node_base<T> * upper_bound_node(const K & k) const {
+        const node_base<T> * nil = root->parent;
+        const node_base<T> * result = nil;
+        const node_base<T> * x = root;
+        descent_stats stats(counters());
+        while (x != nil) {
+            stats.visit(1);
+            if (comp()(k, key(x))) {
+                result = x;
+                x = x->left;
+            } else {
+                x = x->right;
+            }
+        }
+        return result;
+    }
+
+    template <typename K>
+    std::size_t count_range_keys(const K & first, const K & last) const {
+        if (!comp()(first, last)) return 0;
+        if constexpr (std::is_same<Augment, subtree_size>::value) {
+            return rank_key(last) - rank_key(first);
+        } else {
+            auto nil = root->parent;
+            auto x = lower_bound_node(first);
+            std::size_t n = 0;
+            for (; x != nil && comp()(key(x), last); ++n) {
+                x = successor(const_cast<node_base<T> *>(x));
+            }
+            return n;
+        }
+    }
+
+    template <typename K>
+    const node_base<T> * lower_bound_node(
+            const K & k, const node_base<T> * from = nullptr) const {
+        const node_base<T> * nil = root->parent;
+        const node_base<T> * result = nil;
+        const node_base<T> * x = from ? from : root;
+        descent_stats stats(counters());
+        while (x != nil) {
+            stats.visit(1);
+            if (comp()(key(x), k)) {
+                x = x->right;
+            } else {
+                result = x;
+                x = x->left;
+            }
+        }
+        return result;
+    }
+
+    static constexpr std::size_t lookup_group = 16;
+
+    // Looks up n <= lookup_group keys in lockstep: every round takes each
+    // unfinished search one level down and prefetches the node it moved
+    // to, so the cache misses of the group overlap instead of following
+    // each other. Sets result[j] to the first element not ordered before
+    // *k[j], like lower_bound_node.
+    void lower_bound_group(const Key * const * k, std::size_t n,
+                           const node_base<T> ** result) const {
+        const node_base<T> * nil = root->parent;
+        const node_base<T> * x[lookup_group];
+        std::size_t active = 0;
+        for (std::size_t j = 0; j < n; ++j) {
+            x[j] = root;
+            result[j] = nil;
+            active += root != nil;
+        }
+        while (active != 0) {
+            active = 0;
+            for (std::size_t j = 0; j < n; ++j) {
+                if (x[j] == nil) continue;
+                if (comp()(key(x[j]), *k[j])) {
+                    x[j] = x[j]->right;
+                } else {
+                    result[j] = x[j];
+                    x[j] = x[j]->left;
+                }
+#if defined(__GNUC__)
+                __builtin_prefetch(x[j]);
+#endif
+                active += x[j] != nil;
+            }
+        }
+    }
+
+    // Calls f(node) for every key of [first, last) in order, with the
+    // first element of that key or nullptr.
+    template <typename ForwardIt, typename F>
+    void find_each(ForwardIt first, ForwardIt last, F f) const {
+        auto nil = root->parent;
+        const Key * k[lookup_group];
+        const node_base<T> * result[lookup_group];
+        while (first != last) {
+            std::size_t n = 0;
+            for (; n < lookup_group && first != last; ++n, ++first) {
+                k[n] = &*first;
+            }
+            lower_bound_group(k, n, result);
+            for (std::size_t j = 0; j < n; ++j) {
+                auto x = result[j];
+                f(x == nil || comp()(*k[j], key(x)) ? nullptr : x);
+            }
+        }
+    }
+
+    // Finger search for batches of ascending keys: climbs from f, a node
+    // ordered before k, to the lowest ancestor whose subtree holds k's
+    // position (after equal keys if after_equal is set), so a step over
+    // d elements costs O(log d) instead of a descent from the root.
+    template <typename K>
+    node_base<T> * climb_to(node_base<T> * f, const K & k,
+                            bool after_equal) const {
+        auto nil = root->parent;
+        auto x = f;
+        while (x->parent != nil) {
+            auto p = x->parent;
+            if (x == p->left && (after_equal ? comp()(k, key(p))
+                                             : !comp()(key(p), k))) {
+                return p;
+            }
+            x = p;
+        }
+        return x;
+    }
+
+    // Indices of items in ascending key order; equal keys stay in input
+    // order.
+    template <typename Item, typename KeyOf>
+    std::vector<std::size_t> sorted_order(
+            const std::vector<const Item *> & items, KeyOf key_of) const {
+        std::vector<std::size_t> order(items.size());
+        for (std::size_t i = 0; i < order.size(); ++i) order[i] = i;
+        std::stable_sort(order.begin(), order.end(),
+                         [&](std::size_t a, std::size_t b) {
+            return comp()(key_of(*items[a]), key_of(*items[b]));
+        });
+        return order;
+    }
+
+    // A detached subtree: its root is black (or the sentinel) and has the
+    // sentinel as parent. height is the number of black nodes on every
+    // path from the root down to a leaf.
+    struct subtree {
+        node_base<T> * root;
+        unsigned height;
+    };
+
+    static unsigned black_height(const node_base<T> * x) {
+        unsigned height = 0;
+        for (; x != &node_base<T>::sentinel; x = x->left) {
+            height += x->color == black;
+        }
+        return height;
+    }
+
+    // Cuts x, a child of a black node of black height parent_height, off
+    // as a subtree of its own.
+    static subtree cut(node_base<T> * x, unsigned parent_height) {
+        auto nil = &node_base<T>::sentinel;
+        subtree result{ x, parent_height - 1 };
+        if (x == nil) return result;
+        x->parent = nil;
+        if (x->color == red) {
+            x->color = black;
+            ++result.height;
+        }
+        return result;
+    }
+
+    // Joins l, k and r, where every key of l is ordered before k and k
+    // before every key of r, in O(|l.height - r.height| + 1). k is hung
+    // off the spine of the taller tree at the shorter one's black height
+    // and repaired like a freshly inserted node.
+    static subtree join_nodes(subtree l, node_base<T> * k, subtree r,
+                              const stats_counters & counters) {
+        auto nil = &node_base<T>::sentinel;
+        if (l.height == r.height) {
+            k->color = black;
+            k->parent = nil;
+            k->left = l.root;
+            k->right = r.root;
+            if (l.root != nil) l.root->parent = k;
+            if (r.root != nil) r.root->parent = k;
+            update(k);
+            return { k, l.height + 1 };
+        }
+        bool left_taller = l.height > r.height;
+        auto & tall = left_taller ? l : r;
+        auto & low = left_taller ? r : l;
+        auto p = nil;
+        auto c = tall.root;
+        auto height = tall.height;
+        while (c->color == red || height > low.height) {
+            height -= c->color == black;
+            p = c;
+            c = left_taller ? c->right : c->left;
+        }
+        k->color = red;
+        k->parent = p;
+        if (left_taller) {
+            p->right = k;
+            k->left = c;
+            k->right = r.root;
+        } else {
+            p->left = k;
+            k->left = l.root;
+            k->right = c;
+        }
+        if (k->left != nil) k->left->parent = k;
+        if (k->right != nil) k->right->parent = k;
+        update_path(k);
+        bool grew = fixup_insert(tall.root, k, counters);
+        return { tall.root, tall.height + grew };
+    }
+
+    struct split_result {
+        subtree left;
+        node_base<T> * middle;
+        subtree right;
+    };
+
+    // Splits t into the keys ordered before k, the node holding k (unique
+    // trees only; nullptr if absent) and the keys after it, in O(log n).
+    template <typename K>
+    split_result split_nodes(subtree t, const K & k) {
+        auto nil = &node_base<T>::sentinel;
+        if (t.root == nil) return { t, nullptr, t };
+        auto x = t.root;
+        auto left = cut(x->left, t.height);
+        auto right = cut(x->right, t.height);
+        if (comp()(k, key(x)) || (Multi && !comp()(key(x), k))) {
+            auto s = split_nodes(left, k);
+            return { s.left, s.middle,
+                     join_nodes(s.right, x, right, counters()) };
+        }
+        if (comp()(key(x), k) || Multi) {
+            auto s = split_nodes(right, k);
+            return { join_nodes(left, x, s.left, counters()), s.middle,
+                     s.right };
+        }
+        return { left, x, right };
+    }
+
+    // Detaches the first node of a non-empty t.
+    static std::pair<node_base<T> *, subtree> split_first(
+            subtree t, const stats_counters & counters) {
+        auto x = t.root;
+        auto left = cut(x->left, t.height);
+        auto right = cut(x->right, t.height);
+        if (left.root == &node_base<T>::sentinel) return { x, right };
+        auto s = split_first(left, counters);
+        return { s.first, join_nodes(s.second, x, right, counters) };
+    }
+
+    // Concatenates l and r without a middle node.
+    static subtree join_nodes(subtree l, subtree r,
+                              const stats_counters & counters) {
+        if (r.root == &node_base<T>::sentinel) return l;
+        auto s = split_first(r, counters);
+        return join_nodes(l, s.first, s.second, counters);
+    }
+
+    // Nodes dropped by a set operation, chained through their parent
+    // links. Each branch of a parallel operation keeps its own list, and
+    // the nodes are destroyed on the calling thread at the end, so the
+    // allocator never sees concurrent calls.
+    struct dropped_nodes {
+        node_base<T> * head = nullptr;
+        node_base<T> * tail = nullptr;
+        std::size_t count = 0;
+
+        void push(node_base<T> * x) {
+            x->parent = head;
+            head = x;
+            if (!tail) tail = x;
+            ++count;
+        }
+
+        void push_subtree(node_base<T> * x) {
+            auto nil = &node_base<T>::sentinel;
+            while (x != nil) {
+                push_subtree(x->left);
+                auto next = x->right;
+                push(x);
+                x = next;
+            }
+        }
+
+        void splice(dropped_nodes & other) {
+            if (!other.head) return;
+            other.tail->parent = head;
+            head = other.head;
+            if (!tail) tail = other.tail;
+            count += other.count;
+        }
+    };
+
+    void destroy_dropped(dropped_nodes & dropped) {
+        while (dropped.head) {
+            auto next = dropped.head->parent;
+            destroy_node(dropped.head);
+            dropped.head = next;
+        }
+    }
+
+    // The nodes, in order, of the smaller of two linked trees about to
+    // meet in a set operation, and the first node of the larger one.
+    struct link_sides {
+        std::vector<node_base<T> *> smaller;
+        node_base<T> * larger_first = nullptr;
+    };
+
+    link_sides smaller_side(const basic_rb_tree & other) const {
+        link_sides sides;
+        if constexpr (Linked) {
+            auto nil = root->parent;
+            auto small = node_count <= other.node_count ? this : &other;
+            auto large = small == this ? &other : this;
+            sides.smaller.reserve(small->node_count);
+            for (auto x = small->header.left; x != nil; x = links(x)->next) {
+                sides.smaller.push_back(x);
+            }
+            sides.larger_first = large->header.left;
+        }
+        return sides;
+    }
+
+    // Set operations leave every node with the links of its old tree.
+    // Unlinking the dropped nodes keeps the survivors of each tree
+    // chained in order; those of the smaller tree then go in after
+    // their predecessors. That costs O(d + m log n) for d dropped nodes
+    // and m on the smaller side, instead of relinking all n.
+    void relink(link_sides & sides, dropped_nodes & dropped) {
+        auto nil = root->parent;
+        // a dropped node points back at itself, but keeps its next
+        for (auto x = dropped.head; x; x = x->parent) {
+            unlink_neighbours(x);
+            links(x)->prev = x;
+        }
+        auto is_dropped = [](node_base<T> * x) {
+            return links(x)->prev == x;
+        };
+        auto first = sides.larger_first;
+        while (first != nil && is_dropped(first)) first = links(first)->next;
+        for (auto z : sides.smaller) {
+            if (is_dropped(z)) continue;
+            auto p = predecessor(z);
+            auto next = p != nil ? links(p)->next : first;
+            if (p == nil) first = z;
+            link_pair(p, z);
+            link_pair(z, next);
+        }
+    }
+
+    // Lower bound on the node count of two subtrees, used to decide
+    // whether splitting the work is worth a fork.
+    static std::size_t estimated_size(subtree a, subtree b) {
+        auto bound = [](unsigned height) {
+            return std::size_t(1) << std::min(height, 62u);
+        };
+        return bound(a.height) + bound(b.height);
+    }
+
+    // Runs f(a1, b1) and f(a2, b2), in parallel when the executor has
+    // workers and the halves are worth it, each with its own list of
+    // dropped nodes, and merges the lists.
+    template <typename Executor, typename F>
+    std::pair<subtree, subtree> fork_halves(Executor & executor,
+                                            dropped_nodes & dropped,
+                                            subtree a1, subtree b1,
+                                            subtree a2, subtree b2, F f) {
+        std::pair<subtree, subtree> result;
+        if (estimated_size(a1, b1) + estimated_size(a2, b2) <=
+            executor.grain_size()) {
+            result.first = f(a1, b1, dropped);
+            result.second = f(a2, b2, dropped);
+            return result;
+        }
+        dropped_nodes right_dropped;
+        executor.fork_join(
+            [&] { result.first = f(a1, b1, dropped); },
+            [&] { result.second = f(a2, b2, right_dropped); });
+        dropped.splice(right_dropped);
+        return result;
+    }
+
+    // Join-based set algebra: one side is split around the root of the
+    // other and the halves are combined recursively, which costs
+    // O(m log(n / m + 1)) for sizes m <= n, with O(log^2 n) span when
+    // the halves run in parallel. Nodes are relinked, never copied.
+    template <typename Executor>
+    subtree union_nodes(subtree a, subtree b, dropped_nodes & dropped,
+                        Executor & executor) {
+        auto nil = &node_base<T>::sentinel;
+        if (a.root == nil) return b;
+        if (b.root == nil) return a;
+        auto x = a.root;
+        auto left = cut(x->left, a.height);
+        auto right = cut(x->right, a.height);
+        auto s = split_nodes(b, key(x));
+        if (s.middle) dropped.push(s.middle);
+        auto halves = fork_halves(executor, dropped,
+                                  left, s.left, right, s.right,
+                                  [&](subtree a, subtree b,
+                                      dropped_nodes & dropped) {
+            return union_nodes(a, b, dropped, executor);
+        });
+        return join_nodes(halves.first, x, halves.second, counters());
+    }
+
+    template <typename Executor>
+    subtree intersection_nodes(subtree a, subtree b,
+                               dropped_nodes & dropped,
+                               Executor & executor) {
+        auto nil = &node_base<T>::sentinel;
+        if (a.root == nil || b.root == nil) {
+            dropped.push_subtree(a.root);
+            dropped.push_subtree(b.root);
+            return { nil, 0 };
+        }
+        auto x = a.root;
+        auto left = cut(x->left, a.height);
+        auto right = cut(x->right, a.height);
+        auto s = split_nodes(b, key(x));
+        auto halves = fork_halves(executor, dropped,
+                                  left, s.left, right, s.right,
+                                  [&](subtree a, subtree b,
+                                      dropped_nodes & dropped) {
+            return intersection_nodes(a, b, dropped, executor);
+        });
+        if (s.middle) {
+            dropped.push(s.middle);
+            return join_nodes(halves.first, x, halves.second, counters());
+        }
+        dropped.push(x);
+        return join_nodes(halves.first, halves.second, counters());
+    }
+
+    template <typename Executor>
+    subtree difference_nodes(subtree a, subtree b, dropped_nodes & dropped,
+                             Executor & executor) {
+        auto nil = &node_base<T>::sentinel;
+        if (a.root == nil || b.root == nil) {
+            dropped.push_subtree(b.root);
+            return a;
+        }
+        auto x = b.root;
+        auto left = cut(x->left, b.height);
+        auto right = cut(x->right, b.height);
+        auto s = split_nodes(a, key(x));
+        auto halves = fork_halves(executor, dropped,
+                                  s.left, left, s.right, right,
+                                  [&](subtree a, subtree b,
+                                      dropped_nodes & dropped) {
+            return difference_nodes(a, b, dropped, executor);
+        });
+        dropped.push(x);
+        if (s.middle) dropped.push(s.middle);
+        return join_nodes(halves.first, halves.second, counters());
+    }
+
+    subtree take_nodes() {
+        subtree result{ root, black_height(root) };
+        root = &node_base<T>::sentinel;
+        node_count = 0;
+        reset_header();
+        return result;
+    }
+
+    void adopt_nodes(subtree t, std::size_t count) {
+        root = t.root;
+        node_count = count;
+        reset_header();
+    }
+
+    // Moving nodes between trees is only sound if either allocator can
+    // free what the other allocated.
+    void check_compatible(basic_rb_tree & other, const char * what) {
+        if (get_node_allocator() != other.get_node_allocator()) {
+            throw std::invalid_argument(std::string(what) +
+                                        ": allocators differ");
+        }
+    }
+
+    // Sizes of two trees holding total nodes together, found by walking
+    // both in step: O(log n + min(|a|, |b|)) unless subtree sizes are
+    // cached.
+    std::size_t count_first(const node_base<T> * a, const node_base<T> * b,
+                            std::size_t total) const {
+        auto nil = &node_base<T>::sentinel;
+        if constexpr (std::is_same<Augment, subtree_size>::value) {
+            return a != nil ? metadata(a) : 0;
+        } else {
+            auto x = minimum(a);
+            auto y = minimum(b);
+            std::size_t n = 0;
+            while (x != nil && y != nil) {
+                x = successor(const_cast<node_base<T> *>(x));
+                y = successor(const_cast<node_base<T> *>(y));
+                ++n;
+            }
+            return x == nil ? n : total - n;
+        }
+    }
+
+public:
+
+    basic_rb_tree()
+            : basic_rb_tree(Compare()) { }
+
+    explicit basic_rb_tree(const Compare & comp,
+                     const Allocator & alloc = Allocator())
+            : compare_holder(comp)
+            , allocator_holder(node_allocator(alloc))
+            , counters_holder(stats_counters())
+            , root(&node_base<T>::sentinel)
+            , node_count(0) {
+        reset_header();
+    }
+
+    explicit basic_rb_tree(const Allocator & alloc)
+            : basic_rb_tree(Compare(), alloc) { }
+
+    template <typename InputIt>
+    basic_rb_tree(InputIt first, InputIt last,
+                  const Compare & comp = Compare(),
+                  const Allocator & alloc = Allocator())
+            : basic_rb_tree(comp, alloc) {
+        insert(first, last);
+    }
+
+    // Builds the tree in O(n) without rotations. [first, last) must be
+    // sorted by Compare, and free of equal keys unless Multi is set.
+    template <typename ForwardIt>
+    basic_rb_tree(ForwardIt first, ForwardIt last, sorted_tag,
+                  const Compare & comp = Compare(),
+                  const Allocator & alloc = Allocator())
+            : basic_rb_tree(comp, alloc) {
+        auto nil = root;
+        auto n = static_cast<std::size_t>(std::distance(first, last));
+        if (n == 0) return;
+        unsigned height = 0;
+        while ((std::size_t(2) << height) <= n) ++height;
+        root = build_sorted(first, n, 0, height == 0 ? 1 : height);
+        node_count = n;
+        root->parent = nil;
+        reset_links();
+    }
+
+    // Builds the tree from unsorted input with the help of an executor
+    // such as work_stealing_pool: nodes are created up front, sorted by
+    // key with a parallel merge sort and linked like the sorted
+    // constructor, all in O(n log n) work. Equal keys behave as with
+    // repeated insert. Compare must not throw.
+    template <typename RandomIt, typename Executor,
+              typename = std::enable_if_t<
+                  is_executor<std::decay_t<Executor>>::value>>
+    basic_rb_tree(RandomIt first, RandomIt last, Executor && executor,
+                  const Compare & comp = Compare(),
+                  const Allocator & alloc = Allocator())
+            : basic_rb_tree(comp, alloc) {
+        auto n = static_cast<std::size_t>(last - first);
+        if (n == 0) return;
+        std::vector<tree_node *> nodes;
+        nodes.reserve(n);
+        create_nodes(first, nodes, n, executor);
+        try {
+            parallel_stable_sort(executor, nodes.begin(), nodes.end(),
+                                 [this](const tree_node * x,
+                                        const tree_node * y) {
+                return this->comp()(key(x), key(y));
+            });
+        } catch (...) {
+            for (auto z : nodes) destroy_node(z);
+            throw;
+        }
+        if constexpr (!Multi) {
+            // the sort is stable, so the first of equal keys survives
+            std::size_t kept = 1;
+            for (std::size_t i = 1; i < n; ++i) {
+                if (this->comp()(key(nodes[kept - 1]), key(nodes[i]))) {
+                    nodes[kept++] = nodes[i];
+                } else {
+                    destroy_node(nodes[i]);
+                }
+            }
+            n = kept;
+        }
+        unsigned height = 0;
+        while ((std::size_t(2) << height) <= n) ++height;
+        root = link_sorted(executor, nodes.data(), n, 0,
+                           height == 0 ? 1 : height);
+        node_count = n;
+        reset_links();
+    }
+
+    // Copies the tree shape and colors as they are. When the allocator can
+    // reserve, all nodes are carved from a single batch.
+    basic_rb_tree(const basic_rb_tree & other)
+            : compare_holder(other.comp())
+            , allocator_holder(node_alloc_traits::
+                  select_on_container_copy_construction(
+                      other.allocator_holder::get()))
+            , counters_holder(stats_counters())
+            , root(&node_base<T>::sentinel)
+            , node_count(0) {
+        reset_header();
+        reserve_nodes(other);
+        node_creator creator{ *this };
+        const node_base<T> * source = other.root;
+        assign_tree(source, other.node_count, creator);
+    }
+
+    basic_rb_tree(basic_rb_tree && other)
+            : compare_holder(other.comp())
+            , allocator_holder(std::move(other.get_node_allocator()))
+            , counters_holder(stats_counters())
+            , root(&node_base<T>::sentinel)
+            , node_count(0) {
+        reset_header();
+        swap_nodes(other);
+    }
+
+    // Reuses this tree's nodes for the copied values and allocates only
+    // the shortfall.
+    basic_rb_tree & operator=(const basic_rb_tree & other) {
+        if (this == &other) return *this;
+        if constexpr (node_alloc_traits::
+                      propagate_on_container_copy_assignment::value) {
+            if (get_node_allocator() != other.allocator_holder::get()) {
+                destroy_all_nodes();
+            }
+            get_node_allocator() = other.allocator_holder::get();
+        }
+        compare_holder::get() = other.comp();
+        node_recycler recycler(*this);
+        const node_base<T> * source = other.root;
+        assign_tree(source, other.node_count, recycler);
+        return *this;
+    }
+
+    // Steals other's nodes when the allocators allow it; otherwise moves
+    // the values into reused nodes.
+    basic_rb_tree & operator=(basic_rb_tree && other) {
+        if (this == &other) return *this;
+        compare_holder::get() = other.comp();
+        if constexpr (node_alloc_traits::
+                      propagate_on_container_move_assignment::value) {
+            destroy_all_nodes();
+            get_node_allocator() = std::move(other.get_node_allocator());
+            swap_nodes(other);
+        } else {
+            if (get_node_allocator() == other.get_node_allocator()) {
+                destroy_all_nodes();
+                swap_nodes(other);
+            } else {
+                node_recycler recycler(*this);
+                assign_tree(other.root, other.node_count, recycler);
+                other.destroy_all_nodes();
+            }
+        }
+        return *this;
+    }
+
+    ~basic_rb_tree() {
+        auto nil = root->parent;
+        if (!release_all_nodes(bulk_release())) {
+            free_nodes(nil, root);
+        }
+    }
+
+    const node_base<T> * minimum(const node_base<T> * x) const {
+        while (x->left != root->parent) {
+            x = x->left;
+        }
+        return x;
+    }
+
+    node_base<T> * minimum(node_base<T> * x) const {
+        while (x->left != root->parent) {
+            x = x->left;
+        }
+        return x;
+    }
+
+    const node_base<T> * maximum(const node_base<T> * x) const {
+        while (x->right != root->parent) {
+            x = x->right;
+        }
+        return x;
+    }
+
+    node_base<T> * maximum(node_base<T> * x) const {
+        while (x->right != root->parent) {
+            x = x->right;
+        }
+        return x;
+    }
+
+    // Like std::set::insert: the new element, or the one whose equal key
+    // kept the value out of a unique tree, and whether it was inserted.
+    // A multi tree always inserts and returns just the element.
+    insert_result insert(const T & value) {
+        return emplace(value);
+    }
+
+    insert_result insert(T && value) {
+        return emplace(std::move(value));
+    }
+
+    // Same as insert, but a rejected node goes back to the caller in the
+    // result; an empty handle inserts nothing and yields end().
+    node_insert_result insert(node_type && handle) {
+        auto nil = root->parent;
+        std::pair<node_base<T> *, bool> r{ nil, false };
+        if (!handle.empty()) {
+            auto position = find_insert_position(key(handle.node));
+            if (position.existing) {
+                r.first = position.existing;
+            } else {
+                r = { handle.release(), true };
+                attach(r.first, position);
+            }
+        }
+        if constexpr (Multi) {
+            return iterator_to(r.first);
+        } else {
+            return { iterator_to(r.first), r.second, std::move(handle) };
+        }
+    }
+
+    // Builds the element in place. When the key can be read from the
+    // arguments, a duplicate is rejected before any node is allocated.
+    template <typename... Args>
+    insert_result emplace(Args &&... args) {
+        return make_insert_result(
+            emplace_near(nullptr, std::forward<Args>(args)...));
+    }
+
+    // Inserts as close as possible before hint (see
+    // hinted_insert_position) and returns the new element, or the one
+    // whose equal key kept the value out of a unique tree.
+    template <typename... Args>
+    iterator emplace_hint(const_iterator hint, Args &&... args) {
+        return iterator_to(emplace_near(&*node_iterator(hint),
+                                        std::forward<Args>(args)...).first);
+    }
+
+    // Like std::set::insert with a hint.
+    iterator insert(const_iterator hint, const T & value) {
+        return emplace_hint(hint, value);
+    }
+
+    iterator insert(const_iterator hint, T && value) {
+        return emplace_hint(hint, std::move(value));
+    }
+
+    // Appends with end() as the hint, so ascending input costs O(1) per
+    // element.
+    template <typename InputIt>
+    void insert(InputIt first, InputIt last) {
+        for (; first != last; ++first) {
+            emplace_near(root->parent, *first);
+        }
+    }
+
+    // Inserts a batch of values in ascending key order, each descent
+    // starting from where the previous one ended; see climb_to. Returns,
+    // in input order, whether each value was inserted. For a batch of b
+    // keys this costs O(b log b + b log(n / b + 1)) comparisons, and
+    // neighbouring keys touch the same few cache lines.
+    template <typename ForwardIt>
+    std::vector<bool> insert_batch(ForwardIt first, ForwardIt last) {
+        std::vector<const T *> items;
+        for (; first != last; ++first) items.push_back(&*first);
+        auto order = sorted_order(items, [](const T & value) -> const Key & {
+            return KeyOfValue()(value);
+        });
+        std::vector<bool> inserted(items.size());
+        node_base<T> * finger = nullptr;
+        for (auto i : order) {
+            auto & k = KeyOfValue()(*items[i]);
+            auto from = finger ? climb_to(finger, k, Multi) : nullptr;
+            auto position = find_insert_position(k, from);
+            if (position.existing) {
+                finger = position.existing;
+                continue;
+            }
+            auto z = create_node(std::in_place, *items[i]);
+            attach(z, position);
+            finger = z;
+            inserted[i] = true;
+        }
+        return inserted;
+    }
+
+    // Erases every element whose key is in the batch, walking the batch
+    // in ascending order from one match to the next. Returns, in input
+    // order, whether each key removed anything.
+    template <typename ForwardIt>
+    std::vector<bool> erase_batch(ForwardIt first, ForwardIt last) {
+        std::vector<const Key *> items;
+        for (; first != last; ++first) items.push_back(&*first);
+        auto order = sorted_order(items, [](const Key & k) -> const Key & {
+            return k;
+        });
+        std::vector<bool> erased(items.size());
+        auto nil = root->parent;
+        node_base<T> * finger = nullptr;
+        for (auto i : order) {
+            auto & k = *items[i];
+            node_base<T> * x;
+            if (!finger) {
+                x = const_cast<node_base<T> *>(lower_bound_node(k));
+            } else if (finger == nil || !comp()(key(finger), k)) {
+                x = finger;
+            } else {
+                x = const_cast<node_base<T> *>(
+                    lower_bound_node(k, climb_to(finger, k, false)));
+            }
+            while (x != nil && !comp()(k, key(x))) {
+                auto next = successor(x);
+                erase(x);
+                erased[i] = true;
+                x = next;
+            }
+            finger = x;
+        }
+        return erased;
+    }
+
+    // Write contains(k), or find(k), for every key of [first, last) to
+    // out. The keys are looked up a group at a time with their descents
+    // interleaved (see lower_bound_group), which for a tree far larger
+    // than the cache, and keys in no particular order, is several times
+    // faster than one lookup after another.
+    template <typename ForwardIt, typename OutputIt>
+    OutputIt contains_batch(ForwardIt first, ForwardIt last,
+                            OutputIt out) const {
+        find_each(first, last, [&out](const node_base<T> * x) {
+            *out++ = x != nullptr;
+        });
+        return out;
+    }
+
+    template <typename ForwardIt, typename OutputIt>
+    OutputIt find_batch(ForwardIt first, ForwardIt last, OutputIt out) const {
+        find_each(first, last, [this, &out](const node_base<T> * x) {
+            *out++ = iterator_to(x);
+        });
+        return out;
+    }
+
+    // Unlinks the node and hands its ownership to the caller.
+    node_type extract(const node_base<T> * node) {
+        auto z = const_cast<node_base<T> *>(node);
+        unlink(z);
+        return node_type(static_cast<tree_node *>(z),
+                         get_node_allocator());
+    }
+
+    node_type extract(const Key & k) {
+        auto x = find_key(k);
+        if (!x) return node_type();
+        return extract(x);
+    }
+
+    bool contains(const Key & k) const {
+        return contains_key(k);
+    }
+
+    template <typename K, typename = transparent_key<K>>
+    bool contains(const K & k) const {
+        return contains_key(k);
+    }
+
+    // Removes every element with key k and returns how many there were.
+    std::size_t erase(const Key & k) {
+        auto range = equal_range(k);
+        auto n = node_count;
+        erase(range.first, range.second);
+        return n - node_count;
+    }
+
+    void erase(const node_base<T> * node) {
+        erase(const_cast<node_base<T> *>(node));
+    }
+
+    // Removes the element at pos and returns the one after it.
+    iterator erase(const_iterator pos) {
+        auto x = &*node_iterator(pos);
+        auto next = iterator_to(successor(const_cast<node_base<T> *>(x)));
+        erase(x);
+        return next;
+    }
+
+    // Unlinks [first, last) while walking it; no element is looked up.
+    // Unlinking never relocates other nodes, so the walk stays valid.
+    iterator erase(const_iterator first, const_iterator last) {
+        auto nil = root->parent;
+        auto x = const_cast<node_base<T> *>(&*node_iterator(first));
+        auto end = &*node_iterator(last);
+        if (x == header.left && end == nil) {
+            destroy_all_nodes();
+            return this->end();
+        }
+        while (x != end) {
+            auto next = successor(x);
+            erase(x);
+            x = next;
+        }
+        return iterator_to(end);
+    }
+
+    // Appends the elements of right, all of which must be ordered after
+    // this tree's (or equal to its last one, for Multi), in O(log n).
+    // Nodes change trees, so the allocators must compare equal.
+    void join(basic_rb_tree && right) {
+        check_compatible(right, "basic_rb_tree::join");
+        auto total = node_count + right.node_count;
+        auto last = header.right;
+        auto first = right.header.left;
+        auto l = take_nodes();
+        adopt_nodes(join_nodes(l, right.take_nodes(), counters()), total);
+        if constexpr (Linked) link_pair(last, first);
+    }
+
+    // Same, with the element of middle placed between the two trees.
+    void join(node_type && middle, basic_rb_tree && right) {
+        check_compatible(right, "basic_rb_tree::join");
+        if (middle.empty()) return join(std::move(right));
+        if (*middle.alloc != get_node_allocator()) {
+            throw std::invalid_argument(
+                "basic_rb_tree::join: allocators differ");
+        }
+        auto total = node_count + 1 + right.node_count;
+        auto last = header.right;
+        auto first = right.header.left;
+        auto l = take_nodes();
+        auto r = right.take_nodes();
+        auto m = middle.release();
+        adopt_nodes(join_nodes(l, m, r, counters()), total);
+        if constexpr (Linked) {
+            link_pair(last, m);
+            link_pair(m, first);
+        }
+    }
+
+    // Keeps the elements ordered before k and moves the rest into the
+    // returned tree. Splitting is O(log n); working out the two sizes
+    // costs O(min) more unless the tree keeps subtree sizes.
+    basic_rb_tree split(const Key & k) {
+        basic_rb_tree right(comp(), Allocator(get_node_allocator()));
+        auto total = node_count;
+        // a linked tree is cut between the first node of right and the
+        // one before it
+        node_base<T> * cut = root->parent;
+        if constexpr (Linked) {
+            cut = const_cast<node_base<T> *>(lower_bound_node(k));
+        }
+        auto s = split_nodes(take_nodes(), k);
+        auto upper = s.right;
+        if (s.middle) {
+            upper = join_nodes({ &node_base<T>::sentinel, 0 }, s.middle,
+                               upper, counters());
+        }
+        auto n = count_first(s.left.root, upper.root, total);
+        adopt_nodes(s.left, n);
+        right.adopt_nodes(upper, total - n);
+        if constexpr (Linked) {
+            if (cut != root->parent) {
+                link_pair(links(cut)->prev, root->parent);
+                link_pair(root->parent, cut);
+            }
+        }
+        return right;
+    }
+
+    // Set algebra on unique trees, consuming other and reusing its nodes.
+    // Equal keys keep this tree's element. Cost is O(m log(n / m + 1))
+    // for sizes m <= n, plus destroying the dropped nodes. Given an
+    // executor such as work_stealing_pool, independent halves run in
+    // parallel; Compare must not throw.
+    template <typename Executor = sequential_executor>
+    void set_union(basic_rb_tree && other,
+                   Executor && executor = Executor()) {
+        static_assert(!Multi, "set_union() needs unique keys");
+        check_compatible(other, "basic_rb_tree::set_union");
+        auto total = node_count + other.node_count;
+        dropped_nodes duplicates;
+        auto smaller = smaller_side(other);
+        auto a = take_nodes();
+        auto t = union_nodes(a, other.take_nodes(), duplicates, executor);
+        adopt_nodes(t, total - duplicates.count);
+        if constexpr (Linked) relink(smaller, duplicates);
+        destroy_dropped(duplicates);
+    }
+
+    template <typename Executor = sequential_executor>
+    void set_intersection(basic_rb_tree && other,
+                          Executor && executor = Executor()) {
+        static_assert(!Multi, "set_intersection() needs unique keys");
+        check_compatible(other, "basic_rb_tree::set_intersection");
+        auto total = node_count + other.node_count;
+        dropped_nodes dropped;
+        auto smaller = smaller_side(other);
+        auto a = take_nodes();
+        auto t = intersection_nodes(a, other.take_nodes(), dropped,
+                                    executor);
+        adopt_nodes(t, total - dropped.count);
+        if constexpr (Linked) relink(smaller, dropped);
+        destroy_dropped(dropped);
+    }
+
+    template <typename Executor = sequential_executor>
+    void set_difference(basic_rb_tree && other,
+                        Executor && executor = Executor()) {
+        static_assert(!Multi, "set_difference() needs unique keys");
+        check_compatible(other, "basic_rb_tree::set_difference");
+        auto total = node_count + other.node_count;
+        dropped_nodes dropped;
+        auto smaller = smaller_side(other);
+        auto a = take_nodes();
+        auto t = difference_nodes(a, other.take_nodes(), dropped,
+                                  executor);
+        adopt_nodes(t, total - dropped.count);
+        if constexpr (Linked) relink(smaller, dropped);
+        destroy_dropped(dropped);
+    }
+
+    // The element with key k, or end().
+    iterator find(const Key & k) {
+        return iterator_to(find_key(k));
+    }
+
+    const_iterator find(const Key & k) const {
+        return iterator_to(find_key(k));
+    }
+
+    template <typename K, typename = transparent_key<K>>
+    iterator find(const K & k) {
+        return iterator_to(find_key(k));
+    }
+
+    template <typename K, typename = transparent_key<K>>
+    const_iterator find(const K & k) const {
+        return iterator_to(find_key(k));
+    }
+
+    // First element not ordered before the argument, or end().
+    iterator lower_bound(const Key & k) {
+        return iterator_to(lower_bound_node(k));
+    }
+
+    const_iterator lower_bound(const Key & k) const {
+        return iterator_to(lower_bound_node(k));
+    }
+
+    template <typename K, typename = transparent_key<K>>
+    iterator lower_bound(const K & k) {
+        return iterator_to(lower_bound_node(k));
+    }
+
+    template <typename K, typename = transparent_key<K>>
+    const_iterator lower_bound(const K & k) const {
+        return iterator_to(lower_bound_node(k));
+    }
+
+    // First element ordered after the argument, or end().
+    iterator upper_bound(const Key & k) {
+        return iterator_to(upper_bound_node(k));
+    }
+
+    const_iterator upper_bound(const Key & k) const {
+        return iterator_to(upper_bound_node(k));
+    }
+
+    template <typename K, typename = transparent_key<K>>
+    iterator upper_bound(const K & k) {
+        return iterator_to(upper_bound_node(k));
+    }
+
+    template <typename K, typename = transparent_key<K>>
+    const_iterator upper_bound(const K & k) const {
+        return iterator_to(upper_bound_node(k));
+    }
+
+    std::pair<iterator, iterator> equal_range(const Key & k) {
+        return { lower_bound(k), upper_bound(k) };
+    }
+
+    std::pair<const_iterator, const_iterator> equal_range(
+            const Key & k) const {
+        return { lower_bound(k), upper_bound(k) };
+    }
+
+    template <typename K, typename = transparent_key<K>>
+    std::pair<iterator, iterator> equal_range(const K & k) {
+        return { lower_bound(k), upper_bound(k) };
+    }
+
+    template <typename K, typename = transparent_key<K>>
+    std::pair<const_iterator, const_iterator> equal_range(
+            const K & k) const {
+        return { lower_bound(k), upper_bound(k) };
+    }
+
+    // Number of elements with keys in [first, last): O(log n) for
+    // order_statistic_tree, O(log n + count) otherwise.
+    std::size_t count_range(const Key & first, const Key & last) const {
+        return count_range_keys(first, last);
+    }
+
+    template <typename K, typename = transparent_key<K>>
+    std::size_t count_range(const K & first, const K & last) const {
+        return count_range_keys(first, last);
+    }
+
+    std::size_t size() const {
+        return node_count;
+    }
+
+    bool empty() const {
+        return node_count == 0;
+    }
+
+    // Snapshot of this tree's counters, all zero unless RB_TREE_STATS is
+    // defined, with its size and black height. Counting starts when the
+    // tree is created, copied or reset_stats() is called.
+    rb_tree_stats stats() const {
+        auto result = counters().snapshot();
+        result.size = node_count;
+        result.black_height = black_height(root);
+        return result;
+    }
+
+    void reset_stats() {
+        counters_holder::get().reset();
+    }
+
+    // Removes every element in O(n) with no recursion. Trivially
+    // destructible values in nodes of a pool_allocator that no other
+    // tree shares skip the walk: the pool is released as a whole.
+    void clear() {
+        destroy_all_nodes();
+    }
+
+    // The element with k elements before it (0-based), or end() if k is
+    // out of range. Requires the subtree_size augmentation.
+    const_iterator select(std::size_t k) const {
+        static_assert(std::is_same<Augment, subtree_size>::value,
+                      "select() needs subtree_size augmentation");
+        auto nil = root->parent;
+        auto x = root;
+        while (x != nil) {
+            auto left = x->left != nil ? metadata(x->left) : 0;
+            if (k < left) {
+                x = x->left;
+            } else if (k == left) {
+                break;
+            } else {
+                k -= left + 1;
+                x = x->right;
+            }
+        }
+        return iterator_to(x);
+    }
+
+    // Number of elements ordered before k. Requires the subtree_size
+    // augmentation.
+    std::size_t rank(const Key & k) const {
+        return rank_key(k);
+    }
+
+    template <typename K, typename = transparent_key<K>>
+    std::size_t rank(const K & k) const {
+        return rank_key(k);
+    }
+
+    Compare key_comp() const {
+        return comp();
+    }
+
+    void print_by_level(std::ostream & os) const {
+        if (!root) os << "<empty>" << std::endl;
+        std::stack<std::pair<node_base<T> *, unsigned>> nodes;
+        auto cur_node = root;
+        auto depth = 1u;
+        while (true) {
+            if (root->parent != cur_node) {
+                nodes.push({ cur_node, depth });
+                cur_node = cur_node->right;
+                depth += 6;
+            } else if (!nodes.empty()) {
+                cur_node = nodes.top().first;
                 depth = nodes.top().second;
                 nodes.pop();
                 os << ">" << std::setw(depth) << ' '
@@ -511,20 +2827,107 @@ public:
         os << std::endl;
     }
 
+    // Cached metadata of a node of this tree; augmented trees only.
+    static const auto & node_metadata(const node_base<T> * x) {
+        return metadata(x);
+    }
+
     const node_base<T> * get_root() const {
         return root;
     }
 
-    const_rb_tree_iterator<T> begin() const {
-        return const_rb_tree_iterator<T>(root->parent->left,
-                                         root->parent);
+    iterator begin() {
+        return iterator_to(header.left);
+    }
+
+    const_iterator begin() const {
+        return iterator_to(header.left);
+    }
+
+    iterator end() {
+        return iterator_to(root->parent);
+    }
+
+    const_iterator end() const {
+        return iterator_to(root->parent);
+    }
+
+    const_iterator cbegin() const {
+        return begin();
+    }
+
+    const_iterator cend() const {
+        return end();
     }
 
-    const_rb_tree_iterator<T> end() const {
-        return const_rb_tree_iterator<T>(root->parent,
-                                         root->parent);
+    reverse_iterator rbegin() {
+        return reverse_iterator(end());
+    }
+
+    const_reverse_iterator rbegin() const {
+        return const_reverse_iterator(end());
+    }
+
+    reverse_iterator rend() {
+        return reverse_iterator(begin());
+    }
+
+    const_reverse_iterator rend() const {
+        return const_reverse_iterator(begin());
+    }
+
+    // The nodes rather than the values, e.g. to keep handles for
+    // erase(const node_base<T> *) or to inspect the structure.
+    rb_tree_range<node_iterator> nodes() const {
+        return { node_iterator(header.left, &header),
+                 node_iterator(root->parent, &header) };
+    }
+
+    // Iterator at a node of this tree, such as insert() returns; end()
+    // for nullptr.
+    iterator iterator_to(const node_base<T> * node) {
+        return iterator(node_iterator(node ? node : root->parent,
+                                                  &header));
+    }
+
+    const_iterator iterator_to(const node_base<T> * node) const {
+        return const_iterator(node_iterator(
+            node ? node : root->parent, &header));
     }
 
 };
 
+template <typename T,
+          typename Compare = std::less<T>,
+          typename Allocator = std::allocator<T>>
+using rb_tree =
+    basic_rb_tree<T, T, identity_key, Compare, Allocator, false>;
+
+template <typename T,
+          typename Compare = std::less<T>,
+          typename Allocator = std::allocator<T>>
+using rb_multiset =
+    basic_rb_tree<T, T, identity_key, Compare, Allocator, true>;
+
+// Set whose nodes also link to their neighbours in key order, so that
+// iterators step in O(1) and a scan is one pointer chase per element.
+// Costs two pointers per node and a few writes per insertion and
+// removal. join and split splice the lists at the seam in O(1); a set
+// operation splices in each node of the smaller tree, in O(log n) per
+// node.
+template <typename T,
+          typename Compare = std::less<T>,
+          typename Allocator = std::allocator<T>>
+using linked_rb_tree =
+    basic_rb_tree<T, T, identity_key, Compare, Allocator, false,
+                  no_augment, true>;
+
+// Set with O(log n) select() and rank().
+template <typename T,
+          typename Compare = std::less<T>,
+          typename Allocator = std::allocator<T>>
+using order_statistic_tree =
+    basic_rb_tree<T, T, identity_key, Compare, Allocator, false,
+                  subtree_size>;
+
 #endif
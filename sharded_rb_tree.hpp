@@ -0,0 +1,171 @@
+#ifndef SHARDED_RB_TREE_HPP
+#define SHARDED_RB_TREE_HPP
+
+#include "rb_tree.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <utility>
+#include <vector>
+
+// Set that takes any number of concurrent writers. Keys are partitioned
+// by range into shards, each an rb_tree behind its own reader-writer
+// lock, so updates of keys in different shards never contend. Shard i
+// holds the keys k with splitters[i - 1] <= k < splitters[i].
+//
+// Values are visited in order, across shards, by for_each, either all of
+// them or those of a key range, one shard at a time.
+//
+// The splitters are fixed, so they should follow the expected key
+// distribution; the sampling constructor picks them from a sample of
+// keys. Every shard gets a copy of the allocator, and those copies are
+// used concurrently: pool_allocator, whose copies share one pool, does
+// not qualify.
+template <typename T,
+          typename Compare = std::less<T>,
+          typename Allocator = std::allocator<T>>
+class sharded_rb_tree : private ebo_storage<Compare, 0> {
+    using compare_holder = ebo_storage<Compare, 0>;
+
+    // own cache line, so that locking one shard does not slow the next
+    struct alignas(64) shard {
+        mutable std::shared_mutex mutex;
+        rb_tree<T, Compare, Allocator> tree;
+
+        shard(const Compare & comp, const Allocator & alloc)
+                : tree(comp, alloc) { }
+    };
+
+    std::vector<T> splitters;
+    std::vector<std::unique_ptr<shard>> shards;
+
+    const Compare & comp() const {
+        return compare_holder::get();
+    }
+
+    std::size_t shard_index(const T & k) const {
+        auto i = std::upper_bound(splitters.begin(), splitters.end(), k,
+                                  comp()) - splitters.begin();
+        return static_cast<std::size_t>(i);
+    }
+
+    shard & route(const T & k) const {
+        return *shards[shard_index(k)];
+    }
+
+    void create_shards(const Allocator & alloc) {
+        std::sort(splitters.begin(), splitters.end(), comp());
+        splitters.erase(std::unique(splitters.begin(), splitters.end(),
+                                    [this](const T & lhs, const T & rhs) {
+                                        return !comp()(lhs, rhs);
+                                    }),
+                        splitters.end());
+        for (std::size_t i = 0; i <= splitters.size(); ++i) {
+            shards.push_back(std::make_unique<shard>(comp(), alloc));
+        }
+    }
+
+public:
+
+    explicit sharded_rb_tree(std::vector<T> splitters,
+                             const Compare & comp = Compare(),
+                             const Allocator & alloc = Allocator())
+            : compare_holder(comp)
+            , splitters(std::move(splitters)) {
+        create_shards(alloc);
+    }
+
+    // Splits the keys of [first, last) into shard_count shards of about
+    // the same size.
+    template <typename InputIt>
+    sharded_rb_tree(InputIt first, InputIt last, std::size_t shard_count,
+                    const Compare & comp = Compare(),
+                    const Allocator & alloc = Allocator())
+            : compare_holder(comp) {
+        std::vector<T> sample(first, last);
+        std::sort(sample.begin(), sample.end(), this->comp());
+        for (std::size_t i = 1; i < shard_count && !sample.empty(); ++i) {
+            splitters.push_back(sample[i * sample.size() / shard_count]);
+        }
+        create_shards(alloc);
+    }
+
+    sharded_rb_tree(const sharded_rb_tree &) = delete;
+
+    sharded_rb_tree & operator=(const sharded_rb_tree &) = delete;
+
+    // Both return false, and change nothing, if the key is already
+    // present (insert) or absent (erase).
+    bool insert(const T & value) {
+        auto & s = route(value);
+        std::lock_guard<std::shared_mutex> lock(s.mutex);
+        return s.tree.insert(value).second;
+    }
+
+    bool insert(T && value) {
+        auto & s = route(value);
+        std::lock_guard<std::shared_mutex> lock(s.mutex);
+        return s.tree.insert(std::move(value)).second;
+    }
+
+    bool erase(const T & k) {
+        auto & s = route(k);
+        std::lock_guard<std::shared_mutex> lock(s.mutex);
+        return s.tree.erase(k) != 0;
+    }
+
+    bool contains(const T & k) const {
+        auto & s = route(k);
+        std::shared_lock<std::shared_mutex> lock(s.mutex);
+        return s.tree.contains(k);
+    }
+
+    // Sum over the shards, each counted at a slightly different time.
+    std::size_t size() const {
+        std::size_t result = 0;
+        for (auto & s : shards) {
+            std::shared_lock<std::shared_mutex> lock(s->mutex);
+            result += s->tree.size();
+        }
+        return result;
+    }
+
+    // Calls f with every value in order. Each shard is read under its
+    // lock, so f sees a consistent shard at a time, not one instant of
+    // the whole set, and must not update the set itself.
+    template <typename F>
+    void for_each(F f) const {
+        for (auto & s : shards) {
+            std::shared_lock<std::shared_mutex> lock(s->mutex);
+            for (auto & value : s->tree) f(value);
+        }
+    }
+
+    // Same for the values v with lo <= v < hi, reading only the shards
+    // whose keys can fall in that range.
+    template <typename F>
+    void for_each(const T & lo, const T & hi, F f) const {
+        if (!comp()(lo, hi)) return;
+        auto last = shard_index(hi);
+        for (auto i = shard_index(lo); i <= last; ++i) {
+            auto & s = *shards[i];
+            std::shared_lock<std::shared_mutex> lock(s.mutex);
+            auto end = s.tree.end();
+            for (auto it = s.tree.lower_bound(lo);
+                 it != end && comp()(*it, hi); ++it) {
+                f(*it);
+            }
+        }
+    }
+
+    std::size_t shard_count() const {
+        return shards.size();
+    }
+
+};
+
+#endif
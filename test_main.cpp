@@ -0,0 +1,10 @@
+#include "tests.hpp"
+
+#include <iostream>
+
+// Runs the tests alone. The build compiles it twice: as tests, where the
+// stats compile away, and with RB_TREE_STATS as stats_tests.
+int main() {
+    test();
+    std::cout << "tests ok" << std::endl;
+}
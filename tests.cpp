@@ -1,6 +1,23 @@
 #include "tests.hpp"
+#include "rb_map.hpp"
+#include "interval_tree.hpp"
+#include "work_stealing_pool.hpp"
+#include "persistent_rb_tree.hpp"
+#include "concurrent_rb_tree.hpp"
+#include "sharded_rb_tree.hpp"
+#include "compact_rb_tree.hpp"
+#include "frozen_set.hpp"
+#include "blocked_frozen_set.hpp"
 
+#include <algorithm>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
 
 template <typename T>
 bool are_equal_nodes(const node_base<T> * lnil, const node_base<T> * lhs,
@@ -61,7 +78,7 @@ void free_nodes(const node_base<T> * node, const node_base<T> * nil = nullptr) {
     while (node != nil) {
         free_nodes(node->right, nil);
         auto left = node->left;
-        delete node;
+        delete static_cast<const node_with_value<T> *>(node);
         node = left;
     }
 }
@@ -121,7 +138,9 @@ struct root_holder {
     root_holder(const node_base<T> & root_holder) = delete;
 
     ~root_holder() {
-        free_nodes(root, root->parent);
+        auto nil = root->parent;
+        free_nodes(root, nil);
+        delete nil;
     }
 };
 
@@ -378,6 +397,1541 @@ void insert_13_seq() {
     assert_equal(expected.root, actual.get_root());
 }
 
+void pool_allocator_reuses_freed_slots() {
+    pool_allocator<int> alloc;
+    auto first = alloc.allocate(1);
+    alloc.deallocate(first, 1);
+    auto second = alloc.allocate(1);
+    if (first != second) {
+        std::cout << "pool did not reuse freed slot" << std::endl;
+        throw;
+    }
+    alloc.deallocate(second, 1);
+}
+
+// Small chunks, so the pool keeps adding them: each addition must stay
+// O(1) amortized, or this takes minutes.
+void pool_allocator_many_chunks() {
+    pool_allocator<long, 16> alloc;
+    std::vector<long *> slots(4000000);
+    for (auto & slot : slots) {
+        slot = alloc.allocate(1);
+        *slot = 0;
+    }
+    for (std::size_t i = 0; i < slots.size(); i += 2) {
+        alloc.deallocate(slots[i], 1);
+    }
+    for (std::size_t i = 0; i < slots.size(); i += 2) {
+        slots[i] = alloc.allocate(1);
+    }
+    std::sort(slots.begin(), slots.end());
+    if (std::adjacent_find(slots.begin(), slots.end()) != slots.end()) {
+        std::cout << "pool handed out a slot twice" << std::endl;
+        throw;
+    }
+    for (auto slot : slots) alloc.deallocate(slot, 1);
+}
+
+void pool_allocator_tree() {
+    rb_tree<int, std::less<int>, pool_allocator<int, 16>> actual;
+    std::vector<decltype(actual)::iterator> positions;
+    for (int i = 0; i < 1000; ++i) {
+        auto inserted = actual.insert((i * 7919) % 1000);
+        if (!inserted.second) {
+            std::cout << "insert of unique value failed" << std::endl;
+            throw;
+        }
+        positions.push_back(inserted.first);
+    }
+    for (int i = 0; i < 1000; i += 2) {
+        actual.erase(positions[i]);
+    }
+    check<int>(actual.get_root());
+    for (int i = 0; i < 1000; ++i) {
+        if (actual.contains((i * 7919) % 1000) != (i % 2 == 1)) {
+            std::cout << "wrong contents after erase" << std::endl;
+            throw;
+        }
+    }
+}
+
+void custom_compare() {
+    rb_tree<int, std::greater<int>> actual;
+    for (int i = 1; i <= 10; ++i) actual.insert(i);
+    int expected = 10;
+    for (auto & value : actual) {
+        if (value != expected--) {
+            std::cout << "greater<int> tree iterates out of order"
+                      << std::endl;
+            throw;
+        }
+    }
+    if (*actual.lower_bound(5) != 5 ||
+        actual.lower_bound(0) != actual.end()) {
+        std::cout << "lower_bound ignores comparator" << std::endl;
+        throw;
+    }
+}
+
+void transparent_lookup() {
+    rb_tree<std::string, std::less<>> actual;
+    for (auto s : { "delta", "alpha", "charlie", "bravo" }) {
+        actual.insert(s);
+    }
+    if (!actual.contains(std::string_view("charlie")) ||
+        actual.contains(std::string_view("echo"))) {
+        std::cout << "string_view contains is wrong" << std::endl;
+        throw;
+    }
+    if (*actual.lower_bound(std::string_view("c"))
+            != "charlie" ||
+        actual.lower_bound(std::string_view("e")) != actual.end()) {
+        std::cout << "string_view lower_bound is wrong" << std::endl;
+        throw;
+    }
+}
+
+void map_operations() {
+    rb_map<std::string, int> actual;
+    actual["b"] = 2;
+    actual["a"] = 1;
+    ++actual["a"];
+    auto emplaced = actual.try_emplace("a", 100);
+    auto assigned = actual.insert_or_assign("b", 20);
+    auto inserted = actual.insert_or_assign("c", 3);
+    if (emplaced.second || emplaced.first->second != 2 ||
+        assigned.second || actual.at("b") != 20 ||
+        !inserted.second || actual.at("c") != 3) {
+        std::cout << "rb_map insertion semantics are wrong" << std::endl;
+        throw;
+    }
+    bool thrown = false;
+    try {
+        actual.at("d");
+    } catch (const std::out_of_range &) {
+        thrown = true;
+    }
+    if (!thrown) {
+        std::cout << "rb_map::at does not throw" << std::endl;
+        throw;
+    }
+    std::string keys;
+    for (auto & value : actual) keys += value.first;
+    if (keys != "abc") {
+        std::cout << "rb_map iterates out of order: " << keys << std::endl;
+        throw;
+    }
+}
+
+void multiset_keeps_duplicates() {
+    rb_multiset<int> actual;
+    std::vector<rb_multiset<int>::iterator> positions;
+    for (int i = 0; i < 200; ++i) {
+        positions.push_back(actual.insert(i % 10));
+    }
+    check<int>(actual.get_root());
+    for (int i = 0; i < 200; i += 3) {
+        actual.erase(positions[i]);
+    }
+    check<int>(actual.get_root());
+    int count = 0;
+    int previous = 0;
+    for (auto & value : actual) {
+        if (value < previous) {
+            std::cout << "multiset iterates out of order" << std::endl;
+            throw;
+        }
+        previous = value;
+        ++count;
+    }
+    if (count != 200 - 67) {
+        std::cout << "multiset lost elements: " << count << std::endl;
+        throw;
+    }
+}
+
+void multimap_keeps_insertion_order() {
+    rb_multimap<int, int> actual;
+    for (int i = 0; i < 30; ++i) {
+        actual.insert(std::make_pair(i % 3, i));
+    }
+    int previous_key = 0;
+    int previous_value = -1;
+    for (auto & value : actual) {
+        if (value.first == previous_key && value.second < previous_value) {
+            std::cout << "equal keys lost insertion order" << std::endl;
+            throw;
+        }
+        previous_key = value.first;
+        previous_value = value.second;
+    }
+}
+
+template <typename T>
+struct counting_allocator {
+    using value_type = T;
+
+    static unsigned allocations;
+
+    counting_allocator() = default;
+
+    template <typename U>
+    counting_allocator(const counting_allocator<U> &) { }
+
+    T * allocate(std::size_t n) {
+        ++allocations;
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T * p, std::size_t n) {
+        std::allocator<T>().deallocate(p, n);
+    }
+
+    template <typename U>
+    bool operator==(const counting_allocator<U> &) const { return true; }
+
+    template <typename U>
+    bool operator!=(const counting_allocator<U> &) const { return false; }
+};
+
+template <typename T>
+unsigned counting_allocator<T>::allocations = 0;
+
+void duplicate_insert_does_not_allocate() {
+    using allocator = counting_allocator<std::string>;
+    rb_tree<std::string, std::less<std::string>, allocator> actual;
+    std::string value = "value";
+    actual.insert(value);
+    auto allocations = allocator::allocations;
+    if (actual.insert(value).second ||
+        actual.insert(std::string("value")).second ||
+        actual.emplace(value).second) {
+        std::cout << "duplicate was inserted" << std::endl;
+        throw;
+    }
+    if (allocator::allocations != allocations) {
+        std::cout << "rejected insert allocated a node" << std::endl;
+        throw;
+    }
+    if (!actual.emplace(3, 'x').second || actual.emplace(3, 'x').second) {
+        std::cout << "emplace from constructor arguments is wrong"
+                  << std::endl;
+        throw;
+    }
+}
+
+struct deref_less {
+    bool operator()(const std::unique_ptr<int> & lhs,
+                    const std::unique_ptr<int> & rhs) const {
+        return *lhs < *rhs;
+    }
+};
+
+void move_only_values() {
+    rb_tree<std::unique_ptr<int>, deref_less> actual;
+    for (int i = 0; i < 10; ++i) {
+        actual.insert(std::make_unique<int>(i));
+    }
+    auto emplaced = actual.emplace(new int(42));
+    if (!emplaced.second || **emplaced.first != 42) {
+        std::cout << "emplace of move-only value failed" << std::endl;
+        throw;
+    }
+}
+
+void extract_moves_nodes_between_trees() {
+    rb_map<int, std::string> source;
+    rb_map<int, std::string> target;
+    for (int i = 0; i < 10; ++i) source.emplace(i, std::to_string(i));
+    auto handle = source.extract(4);
+    auto address = &handle.value();
+    if (handle.empty() || source.contains(4) || handle.value().second != "4") {
+        std::cout << "extract did not unlink the node" << std::endl;
+        throw;
+    }
+    auto inserted = target.insert(std::move(handle));
+    if (!inserted.inserted || &*inserted.position != address ||
+        !inserted.node.empty() || !handle.empty() || !target.contains(4)) {
+        std::cout << "node handle insert reallocated" << std::endl;
+        throw;
+    }
+    if (!source.extract(4).empty()) {
+        std::cout << "extract of missing key returned a node" << std::endl;
+        throw;
+    }
+    target.emplace(5, "five");
+    auto duplicate = source.extract(5);
+    auto rejected = target.insert(std::move(duplicate));
+    if (rejected.inserted || rejected.position != target.find(5) ||
+        rejected.node.empty() || rejected.node.value().second != "5") {
+        std::cout << "rejected node handle lost its node" << std::endl;
+        throw;
+    }
+}
+
+void sorted_build() {
+    for (int n = 0; n <= 70; ++n) {
+        std::vector<int> values;
+        for (int i = 0; i < n; ++i) values.push_back(i * 2);
+        rb_tree<int> actual(values.begin(), values.end(), sorted_tag());
+        if (n) check<int>(actual.get_root());
+        int expected = 0;
+        for (auto & value : actual) {
+            if (value != expected) {
+                std::cout << "sorted build lost " << expected << std::endl;
+                throw;
+            }
+            expected += 2;
+        }
+        if (expected != n * 2) {
+            std::cout << "sorted build of " << n << " values has "
+                      << expected / 2 << " elements" << std::endl;
+            throw;
+        }
+        actual.insert(n * 2 + 1);
+        actual.insert(-1);
+        if (n) check<int>(actual.get_root());
+    }
+}
+
+void hinted_insert() {
+    rb_tree<int> actual;
+    for (int i = 0; i < 100; ++i) {
+        actual.insert(actual.end(), i * 3);
+    }
+    for (int i = 99; i >= 0; --i) {
+        actual.insert(actual.lower_bound(i * 3), i * 3 + 1);
+    }
+    // wrong hints must still land in the right place
+    for (int i = 0; i < 100; ++i) {
+        actual.insert(actual.begin(), i * 3 + 2);
+    }
+    auto existing = actual.insert(actual.lower_bound(30), 30);
+    if (actual.size() != 300 || *existing != 30) {
+        std::cout << "hinted insert accepted a duplicate" << std::endl;
+        throw;
+    }
+    check<int>(actual.get_root());
+    int expected = 0;
+    for (auto & value : actual) {
+        if (value != expected++) {
+            std::cout << "hinted insert misplaced "
+                      << value << std::endl;
+            throw;
+        }
+    }
+    rb_multiset<int> multi;
+    for (int i = 0; i < 50; ++i) multi.insert(multi.end(), i / 5);
+    check<int>(multi.get_root());
+}
+
+void copy_preserves_shape() {
+    rb_tree<std::string> source;
+    for (int i = 0; i < 100; ++i) {
+        source.insert(std::to_string(i * 37 % 100));
+    }
+    rb_tree<std::string> copied(source);
+    assert_equal(source.get_root(), copied.get_root());
+    rb_tree<std::string> smaller;
+    smaller.insert("x");
+    smaller = source;
+    assert_equal(source.get_root(), smaller.get_root());
+    rb_tree<std::string> bigger(source);
+    for (int i = 100; i < 300; ++i) bigger.insert(std::to_string(i));
+    bigger = smaller;
+    assert_equal(source.get_root(), bigger.get_root());
+    rb_tree<std::string> moved;
+    moved.insert("y");
+    moved = std::move(bigger);
+    assert_equal(source.get_root(), moved.get_root());
+    if (bigger.begin() != bigger.end()) {
+        std::cout << "moved-from tree is not empty" << std::endl;
+        throw;
+    }
+    rb_tree<std::string> empty;
+    moved = empty;
+    if (moved.begin() != moved.end()) {
+        std::cout << "assigning an empty tree left elements" << std::endl;
+        throw;
+    }
+}
+
+void copy_with_pool() {
+    rb_tree<int, std::less<int>, pool_allocator<int, 4>> source;
+    for (int i = 0; i < 500; ++i) source.insert(i);
+    auto copied = source;
+    assert_equal(source.get_root(), copied.get_root());
+    copied = source;
+    assert_equal(source.get_root(), copied.get_root());
+}
+
+void size_is_tracked() {
+    rb_multiset<int> actual;
+    if (!actual.empty() || actual.size() != 0) {
+        std::cout << "new tree is not empty" << std::endl;
+        throw;
+    }
+    std::vector<rb_multiset<int>::iterator> positions;
+    for (int i = 0; i < 100; ++i) positions.push_back(actual.insert(i % 7));
+    for (int i = 0; i < 100; i += 4) actual.erase(positions[i]);
+    auto handle = actual.extract(3);
+    rb_multiset<int> copied(actual);
+    std::vector<int> values(10, 1);
+    rb_multiset<int> built(values.begin(), values.end(), sorted_tag());
+    if (actual.size() != 74 || copied.size() != 74 || built.size() != 10) {
+        std::cout << "size() is " << actual.size() << ", "
+                  << copied.size() << ", " << built.size() << std::endl;
+        throw;
+    }
+    built = std::move(copied);
+    if (built.size() != 74 || !copied.empty()) {
+        std::cout << "move assignment lost the size" << std::endl;
+        throw;
+    }
+}
+
+void order_statistics() {
+    order_statistic_tree<int> actual;
+    std::vector<int> expected;
+    std::vector<order_statistic_tree<int>::iterator> positions;
+    for (int i = 0; i < 500; ++i) {
+        auto value = (i * 7919) % 1000;
+        positions.push_back(actual.insert(value).first);
+        expected.push_back(value);
+    }
+    for (int i = 0; i < 500; i += 3) {
+        actual.erase(positions[i]);
+        expected[i] = -1;
+    }
+    expected.erase(std::remove(expected.begin(), expected.end(), -1),
+                   expected.end());
+    std::sort(expected.begin(), expected.end());
+    check<int>(actual.get_root());
+    for (std::size_t k = 0; k < expected.size(); ++k) {
+        if (*actual.select(k) != expected[k]) {
+            std::cout << "select(" << k << ") is wrong" << std::endl;
+            throw;
+        }
+    }
+    if (actual.select(expected.size()) != actual.end()) {
+        std::cout << "select past the end is not end()" << std::endl;
+        throw;
+    }
+    for (int value = -1; value <= 1000; ++value) {
+        auto rank = std::lower_bound(expected.begin(), expected.end(),
+                                     value) - expected.begin();
+        if (actual.rank(value) != static_cast<std::size_t>(rank)) {
+            std::cout << "rank(" << value << ") is wrong" << std::endl;
+            throw;
+        }
+    }
+    auto copied = actual;
+    order_statistic_tree<int> built(expected.begin(), expected.end(),
+                                    sorted_tag());
+    if (*copied.select(10) != expected[10] ||
+        *built.select(10) != expected[10]) {
+        std::cout << "copy or sorted build lost subtree sizes" << std::endl;
+        throw;
+    }
+}
+
+struct weight_sum {
+    using metadata = long;
+
+    static long combine(const std::pair<const int, long> & value,
+                        const long * left, const long * right) {
+        return value.second + (left ? *left : 0) + (right ? *right : 0);
+    }
+};
+
+void custom_augmentation() {
+    basic_rb_tree<int, std::pair<const int, long>, pair_first_key,
+                  std::less<int>,
+                  std::allocator<std::pair<const int, long>>,
+                  false, weight_sum> actual;
+    long expected = 0;
+    std::vector<decltype(actual)::iterator> positions;
+    for (int i = 0; i < 300; ++i) {
+        positions.push_back(actual.emplace((i * 7919) % 1000, i).first);
+        expected += i;
+    }
+    for (int i = 0; i < 300; i += 4) {
+        actual.erase(positions[i]);
+        expected -= i;
+    }
+    if (actual.node_metadata(actual.get_root()) != expected) {
+        std::cout << "subtree weight sum is "
+                  << actual.node_metadata(actual.get_root())
+                  << " instead of " << expected << std::endl;
+        throw;
+    }
+}
+
+// Metadata that owns memory: the leftmost key of the subtree, spelled
+// out long enough to defeat the small string optimization.
+struct leftmost_label {
+    using metadata = std::string;
+
+    static std::string combine(const int & value, const std::string * left,
+                               const std::string *) {
+        return left ? *left : "leftmost key of the subtree: " +
+                              std::to_string(value);
+    }
+};
+
+// The pool could drop all nodes at once, but their metadata still has to
+// be destroyed; the sanitizer build reports the leak otherwise.
+void pooled_augmentation() {
+    using tree = basic_rb_tree<int, int, identity_key, std::less<int>,
+                               pool_allocator<int, 16>, false,
+                               leftmost_label>;
+    tree actual;
+    for (int i = 0; i < 300; ++i) actual.insert((i * 7919) % 1000);
+    if (actual.node_metadata(actual.get_root()) !=
+        "leftmost key of the subtree: 0") {
+        std::cout << "wrong leftmost label "
+                  << actual.node_metadata(actual.get_root()) << std::endl;
+        throw;
+    }
+    actual.clear();
+    for (int i = 0; i < 300; ++i) actual.insert(i);
+}
+
+void interval_overlaps() {
+    interval_tree<int> actual;
+    std::vector<interval<int>> intervals;
+    std::vector<interval_tree<int>::iterator> positions;
+    for (int i = 0; i < 400; ++i) {
+        int lo = (i * 7919) % 1000;
+        interval<int> value{ lo, lo + (i * 31) % 50 };
+        intervals.push_back(value);
+        positions.push_back(actual.insert(value.lo, value.hi));
+    }
+    for (int i = 0; i < 400; i += 5) {
+        actual.erase(positions[i]);
+        intervals[i] = interval<int>{ -1, -2 };
+    }
+    for (int lo = -10; lo < 1060; lo += 13) {
+        int hi = lo + lo % 40;
+        std::vector<interval<int>> expected;
+        for (auto & value : intervals) {
+            if (value.lo <= hi && lo <= value.hi && value.lo <= value.hi) {
+                expected.push_back(value);
+            }
+        }
+        std::sort(expected.begin(), expected.end(),
+                  interval_less<int, std::less<int>>());
+        if (actual.overlapping(lo, hi) != expected) {
+            std::cout << "wrong overlaps for [" << lo << ", " << hi << "]"
+                      << std::endl;
+            throw;
+        }
+    }
+}
+
+void range_queries() {
+    rb_multiset<int> actual;
+    for (int i = 0; i < 100; ++i) actual.insert(i / 2 * 2);
+    auto found = actual.find(10);
+    if (found == actual.end() || *found != 10 ||
+        actual.find(11) != actual.end() || found != actual.lower_bound(10)) {
+        std::cout << "find is wrong" << std::endl;
+        throw;
+    }
+    if (*actual.upper_bound(10) != 12 ||
+        actual.upper_bound(98) != actual.end()) {
+        std::cout << "upper_bound is wrong" << std::endl;
+        throw;
+    }
+    auto range = actual.equal_range(20);
+    int count = 0;
+    for (auto it = range.first; it != range.second; ++it) ++count;
+    if (count != 2 || actual.count_range(10, 20) != 10 ||
+        actual.count_range(20, 10) != 0) {
+        std::cout << "equal_range or count_range is wrong" << std::endl;
+        throw;
+    }
+    if (actual.erase(20) != 2 || actual.erase(21) != 0 ||
+        actual.contains(20)) {
+        std::cout << "erase by key is wrong" << std::endl;
+        throw;
+    }
+    order_statistic_tree<int> ranked;
+    for (int i = 0; i < 100; ++i) ranked.insert(i);
+    if (ranked.count_range(-5, 50) != 50 ||
+        ranked.count_range(10, 1000) != 90) {
+        std::cout << "count_range with ranks is wrong" << std::endl;
+        throw;
+    }
+}
+
+void erase_ranges() {
+    rb_tree<int> actual;
+    for (int i = 0; i < 1000; ++i) actual.insert(i);
+    // evict a time window from the front, then a slice from the middle
+    actual.erase(actual.begin(), actual.lower_bound(300));
+    auto next = actual.erase(actual.lower_bound(500),
+                             actual.lower_bound(600));
+    check<int>(actual.get_root());
+    if (*next != 600 || actual.size() != 600 ||
+        *actual.begin() != 300 ||
+        actual.count_range(0, 1000) != 600 ||
+        actual.count_range(500, 600) != 0) {
+        std::cout << "erase of a range is wrong" << std::endl;
+        throw;
+    }
+    actual.erase(actual.begin(), actual.end());
+    if (!actual.empty() || actual.begin() != actual.end()) {
+        std::cout << "erase of everything left elements" << std::endl;
+        throw;
+    }
+    actual.insert(1);
+    check<int>(actual.get_root());
+}
+
+template <typename Tree>
+std::vector<int> contents(const Tree & tree) {
+    std::vector<int> result;
+    for (auto & value : tree) result.push_back(value);
+    return result;
+}
+
+template <typename Tree>
+void check_contents(const Tree & actual, const std::vector<int> & expected,
+                    const char * what) {
+    check<int>(actual.get_root());
+    auto values = contents(actual);
+    if (values != expected || actual.size() != expected.size() ||
+        (!expected.empty() &&
+         *actual.rbegin() != expected.back())) {
+        std::cout << what << " is wrong" << std::endl;
+        throw;
+    }
+}
+
+void clear_and_reuse() {
+    rb_tree<std::string> strings;
+    for (int i = 0; i < 1000; ++i) strings.insert(std::to_string(i * 7919));
+    strings.clear();
+    if (!strings.empty() || strings.begin() != strings.end()) {
+        std::cout << "clear left elements behind" << std::endl;
+        throw;
+    }
+    strings.insert("again");
+    if (strings.size() != 1 || !strings.contains("again")) {
+        std::cout << "tree is unusable after clear" << std::endl;
+        throw;
+    }
+    // the first pool is released in bulk, the shared one node by node
+    using pooled = rb_tree<int, std::less<int>, pool_allocator<int, 16>>;
+    pool_allocator<int, 16> alloc;
+    pooled own, shared(alloc), sharing(alloc);
+    for (int round = 0; round < 2; ++round) {
+        std::vector<int> expected;
+        for (int i = 0; i < 500; ++i) {
+            own.insert((i * 7919) % 500);
+            shared.insert(i);
+            sharing.insert(i);
+            expected.push_back(i);
+        }
+        check_contents(own, expected, "pooled tree after clear");
+        own.clear();
+        shared.clear();
+        check_contents(own, {}, "cleared pooled tree");
+        check_contents(shared, {}, "cleared tree sharing a pool");
+        check_contents(sharing, expected, "tree sharing a cleared pool");
+        sharing.clear();
+    }
+}
+
+void value_iterators() {
+    using tree = rb_tree<int>;
+    static_assert(std::is_same<std::iterator_traits<tree::iterator>::
+                               iterator_category,
+                               std::bidirectional_iterator_tag>::value &&
+                  std::is_same<std::iterator_traits<tree::const_iterator>::
+                               reference, const int &>::value &&
+                  std::is_same<tree::iterator, tree::const_iterator>::value,
+                  "set iterators are read-only bidirectional iterators");
+    tree actual;
+    std::vector<int> expected;
+    for (int i = 0; i < 100; ++i) {
+        auto result = actual.insert((i * 37) % 100);
+        if (!result.second || *result.first != (i * 37) % 100) {
+            std::cout << "insert of a new value is wrong" << std::endl;
+            throw;
+        }
+        expected.push_back(i);
+    }
+    auto duplicate = actual.insert(42);
+    if (duplicate.second || duplicate.first != actual.find(42)) {
+        std::cout << "insert of a duplicate is wrong" << std::endl;
+        throw;
+    }
+    const tree & view = actual;
+    tree::iterator first = actual.begin();
+    if (!std::equal(first, actual.end(), expected.begin(),
+                    expected.end()) ||
+        !std::equal(view.rbegin(), view.rend(), expected.rbegin(),
+                    expected.rend()) ||
+        std::distance(view.cbegin(), view.cend()) != 100 ||
+        *std::find_if(view.begin(), view.end(),
+                      [](int x) { return x > 90; }) != 91 ||
+        std::find(actual.begin(), actual.end(), 42) != actual.find(42) ||
+        view.iterator_to(nullptr) != view.end()) {
+        std::cout << "value iteration is wrong" << std::endl;
+        throw;
+    }
+    // nodes() walks the same elements as node handles
+    auto nodes = view.nodes();
+    if (std::distance(nodes.begin(), nodes.end()) != 100 ||
+        view.iterator_to(&*nodes.begin()) != view.begin() ||
+        (--nodes.end())->get_value() != 99) {
+        std::cout << "node iteration is wrong" << std::endl;
+        throw;
+    }
+    actual.erase(actual.find(10), actual.find(90));
+    expected.erase(expected.begin() + 10, expected.begin() + 90);
+    check_contents(actual, expected, "erase by value iterators");
+    for (auto it = actual.begin(); it != actual.end();) {
+        it = *it % 2 ? actual.erase(it) : std::next(it);
+    }
+    expected.erase(std::remove_if(expected.begin(), expected.end(),
+                                  [](int x) { return x % 2; }),
+                   expected.end());
+    check_contents(actual, expected, "erase at value iterators");
+    rb_map<int, std::string> map;
+    for (int i = 0; i < 10; ++i) map[i] = "";
+    for (auto & entry : map) entry.second = std::to_string(entry.first);
+    rb_map<int, std::string>::const_iterator last = --map.end();
+    if (last->second != "9" || map.at(3) != "3" ||
+        map.find(5)->second != "5") {
+        std::cout << "map values were not changed in place" << std::endl;
+        throw;
+    }
+}
+
+// Checks the links against the tree itself, in both directions.
+template <typename Tree>
+void check_linked(const Tree & actual, const std::vector<int> & expected,
+                  const char * what) {
+    check_contents(actual, expected, what);
+    if (!std::equal(actual.rbegin(), actual.rend(), expected.rbegin(),
+                    expected.rend())) {
+        std::cout << what << " is wrong backwards" << std::endl;
+        throw;
+    }
+}
+
+void linked_trees() {
+    linked_rb_tree<int> actual;
+    std::vector<int> expected;
+    for (int i = 0; i < 1000; ++i) {
+        actual.insert((i * 7919) % 1000);
+        if (i % 3 == 0) actual.erase((i * 31) % 1000);
+    }
+    for (int i = 0; i < 1000; ++i) {
+        if (actual.contains(i)) expected.push_back(i);
+    }
+    check_linked(actual, expected, "linked tree after updates");
+    actual.insert(actual.end(), 5000);
+    actual.insert(actual.begin(), -5);
+    expected.insert(expected.begin(), -5);
+    expected.push_back(5000);
+    check_linked(actual, expected, "linked tree after hinted inserts");
+    auto handle = actual.extract(-5);
+    actual.erase(actual.lower_bound(100), actual.lower_bound(200));
+    expected.erase(expected.begin());
+    expected.erase(std::lower_bound(expected.begin(), expected.end(), 100),
+                   std::lower_bound(expected.begin(), expected.end(), 200));
+    check_linked(actual, expected, "linked tree after erase");
+    auto copy = actual;
+    auto upper = actual.split(500);
+    auto middle = std::lower_bound(expected.begin(), expected.end(), 500);
+    check_linked(actual, std::vector<int>(expected.begin(), middle),
+                 "lower half of linked split");
+    check_linked(upper, std::vector<int>(middle, expected.end()),
+                 "upper half of linked split");
+    actual.join(std::move(upper));
+    actual.insert(std::move(handle));
+    expected.insert(expected.begin(), -5);
+    check_linked(actual, expected, "linked join");
+    check_linked(copy, std::vector<int>(expected.begin() + 1, expected.end()),
+                 "linked copy");
+    linked_rb_tree<int> odd;
+    for (int i = 1; i < 3000; i += 2) odd.insert(i);
+    actual.set_union(std::move(odd));
+    for (int i = 1; i < 3000; i += 2) expected.push_back(i);
+    std::sort(expected.begin(), expected.end());
+    expected.erase(std::unique(expected.begin(), expected.end()),
+                   expected.end());
+    check_linked(actual, expected, "linked union");
+    linked_rb_tree<int> thirds;
+    for (int i = 0; i < 6000; i += 3) thirds.insert(i);
+    actual.set_intersection(std::move(thirds));
+    expected.erase(std::remove_if(expected.begin(), expected.end(),
+                                  [](int x) { return x % 3; }),
+                   expected.end());
+    check_linked(actual, expected, "linked intersection");
+    linked_rb_tree<int> fives;
+    for (int i = 0; i < 600; i += 5) fives.insert(i);
+    actual.set_difference(std::move(fives));
+    expected.erase(std::remove_if(expected.begin(), expected.end(),
+                                  [](int x) { return x < 600 && x % 5 == 0; }),
+                   expected.end());
+    check_linked(actual, expected, "linked difference");
+    // cuts and seams at either end, and around a middle element
+    auto all = actual.split(-1000);
+    check_linked(actual, {}, "empty side of linked split");
+    auto none = all.split(100000);
+    check_linked(none, {}, "empty upper side of linked split");
+    auto top = all.split(expected[expected.size() / 2]);
+    auto pivot = top.extract(expected[expected.size() / 2]);
+    actual.join(std::move(all));
+    actual.join(std::move(pivot), std::move(top));
+    actual.join(std::move(none));
+    check_linked(actual, expected, "linked join around a middle element");
+    std::vector<int> sorted{ 1, 2, 3, 4, 5 };
+    linked_rb_tree<int> built(sorted.begin(), sorted.end(), sorted_tag());
+    built = std::move(actual);
+    check_linked(built, expected, "moved linked tree");
+    built.clear();
+    check_linked(built, {}, "cleared linked tree");
+}
+
+void tree_stats() {
+    static_assert(std::is_empty<rb_tree_counters<false>>::value,
+                  "disabled counters must take no room in a tree");
+    rb_tree<int> tree, other;
+    for (int i = 0; i < 1000; ++i) tree.insert((i * 7919) % 1000);
+    for (int i = 0; i < 1000; ++i) tree.contains(i);
+    for (int i = 0; i < 1000; i += 2) tree.erase(i);
+    auto stats = tree.stats();
+    std::uint64_t histogram = 0;
+    for (auto n : stats.depth_histogram) histogram += n;
+    // both count the black nodes on a path down, the sentinel excluded
+    if (stats.size != 500 || stats.black_height != check_nested<int>(
+            &node_base<int>::sentinel, tree.get_root())) {
+        std::cout << "stats describe the tree wrongly" << std::endl;
+        throw;
+    }
+    if (!rb_tree_stats_enabled) {
+        if (stats.descents != 0 || histogram != 0 ||
+            stats.left_rotations + stats.right_rotations != 0) {
+            std::cout << "disabled stats counted something" << std::endl;
+            throw;
+        }
+        return;
+    }
+    auto insert_rotations = stats.insert_single_rotations +
+                            2 * stats.insert_double_rotations;
+    auto erase_rotations = stats.erase_red_siblings +
+                           stats.erase_near_children +
+                           stats.erase_far_children;
+    // insert and contains descend once, erase(key) twice (equal_range)
+    if (stats.descents != 3000 || histogram != stats.descents ||
+        stats.comparisons < stats.descents ||
+        stats.left_rotations + stats.right_rotations !=
+            insert_rotations + erase_rotations ||
+        stats.insert_recolors == 0 || stats.erase_recolors == 0) {
+        std::cout << "stats counters are inconsistent" << std::endl;
+        throw;
+    }
+    // counters belong to one tree: a copy, or another tree, starts afresh
+    other.insert(1);
+    auto copy = tree;
+    if (other.stats().descents != 1 || copy.stats().descents != 0 ||
+        tree.stats().descents != 3000) {
+        std::cout << "stats leaked between trees" << std::endl;
+        throw;
+    }
+    tree.reset_stats();
+    if (tree.stats().descents != 0 || tree.stats().size != 500) {
+        std::cout << "reset_stats did not clear the counters" << std::endl;
+        throw;
+    }
+}
+
+void join_and_split() {
+    for (int n : { 0, 1, 2, 3, 10, 100, 777 }) {
+        for (int k = -1; k <= n; k += n / 7 + 1) {
+            rb_tree<int> lower;
+            for (int i = 0; i < n; ++i) lower.insert(i);
+            auto upper = lower.split(k);
+            std::vector<int> expected_lower, expected_upper;
+            for (int i = 0; i < n; ++i) {
+                (i < k ? expected_lower : expected_upper).push_back(i);
+            }
+            check_contents(lower, expected_lower, "lower half of split");
+            check_contents(upper, expected_upper, "upper half of split");
+            lower.join(std::move(upper));
+            expected_lower.insert(expected_lower.end(),
+                                  expected_upper.begin(),
+                                  expected_upper.end());
+            check_contents(lower, expected_lower, "join of split halves");
+            if (!upper.empty() || upper.begin() != upper.end()) {
+                std::cout << "joined tree was not emptied" << std::endl;
+                throw;
+            }
+        }
+    }
+    // trees of very different heights, with a middle node
+    rb_tree<int> small, large, middle;
+    small.insert(-5);
+    for (int i = 0; i < 1000; ++i) large.insert(i);
+    middle.insert(-1);
+    small.join(middle.extract(-1), std::move(large));
+    std::vector<int> expected{ -5, -1 };
+    for (int i = 0; i < 1000; ++i) expected.push_back(i);
+    check_contents(small, expected, "join with a middle node");
+    order_statistic_tree<int> ranked;
+    for (int i = 0; i < 300; ++i) ranked.insert(i);
+    auto ranked_upper = ranked.split(100);
+    if (ranked.size() != 100 || ranked_upper.size() != 200 ||
+        *ranked_upper.select(50) != 150 ||
+        ranked_upper.rank(250) != 150) {
+        std::cout << "split lost subtree sizes" << std::endl;
+        throw;
+    }
+    rb_multiset<int> duplicates;
+    for (int i = 0; i < 60; ++i) duplicates.insert(i % 6);
+    auto duplicates_upper = duplicates.split(3);
+    if (duplicates.size() != 30 || duplicates_upper.size() != 30 ||
+        *duplicates_upper.begin() != 3) {
+        std::cout << "split of equal keys is wrong" << std::endl;
+        throw;
+    }
+}
+
+void set_algebra() {
+    using allocator = counting_allocator<int>;
+    using tree = rb_tree<int, std::less<int>, allocator>;
+    auto make = [](int step, int n) {
+        tree result;
+        for (int i = 0; i < n; ++i) result.insert(i * step);
+        return result;
+    };
+    auto operands_of = [&](int n, int m) {
+        return std::make_pair(make(2, n), make(3, m));
+    };
+    for (int n : { 0, 1, 40, 500 }) {
+        for (int m : { 0, 3, 200 }) {
+            auto a = contents(make(2, n));
+            auto b = contents(make(3, m));
+            for (int op = 0; op < 3; ++op) {
+                auto operands = operands_of(n, m);
+                auto & actual = operands.first;
+                auto allocations = allocator::allocations;
+                std::vector<int> expected;
+                if (op == 0) {
+                    actual.set_union(std::move(operands.second));
+                    std::set_union(a.begin(), a.end(), b.begin(), b.end(),
+                                   std::back_inserter(expected));
+                } else if (op == 1) {
+                    actual.set_intersection(std::move(operands.second));
+                    std::set_intersection(a.begin(), a.end(),
+                                          b.begin(), b.end(),
+                                          std::back_inserter(expected));
+                } else {
+                    actual.set_difference(std::move(operands.second));
+                    std::set_difference(a.begin(), a.end(),
+                                        b.begin(), b.end(),
+                                        std::back_inserter(expected));
+                }
+                check_contents(actual, expected, "set operation");
+                if (allocator::allocations != allocations) {
+                    std::cout << "set operation allocated nodes"
+                              << std::endl;
+                    throw;
+                }
+            }
+        }
+    }
+    using pooled = rb_tree<int, std::less<int>, pool_allocator<int>>;
+    pool_allocator<int> shared;
+    pooled a(shared), b(shared), c;
+    for (int i = 0; i < 100; ++i) a.insert(i);
+    for (int i = 50; i < 150; ++i) b.insert(i);
+    a.set_union(std::move(b));
+    if (a.size() != 150 || !b.empty()) {
+        std::cout << "set_union with a shared pool is wrong" << std::endl;
+        throw;
+    }
+    try {
+        a.set_union(std::move(c));
+        std::cout << "set_union accepted foreign nodes" << std::endl;
+        throw;
+    } catch (const std::invalid_argument &) { }
+}
+
+void parallel_operations() {
+    // a small grain makes even these sizes fork all the way down
+    work_stealing_pool pool(4, 16);
+    std::vector<int> input;
+    for (int i = 0; i < 3000; ++i) input.push_back((i * 7919) % 2000);
+    rb_tree<int> built(input.begin(), input.end(), pool);
+    std::vector<int> expected(input);
+    std::sort(expected.begin(), expected.end());
+    expected.erase(std::unique(expected.begin(), expected.end()),
+                   expected.end());
+    check_contents(built, expected, "parallel construction");
+    using pair = std::pair<const int, int>;
+    std::vector<pair> pairs;
+    for (int i = 0; i < 1000; ++i) pairs.emplace_back(i % 10, i);
+    rb_multimap<int, int> multi(pairs.begin(), pairs.end(), pool);
+    int previous = -1;
+    for (auto & value : multi) {
+        if (value.first == 3) {
+            if (value.second <= previous) {
+                std::cout << "parallel construction reordered equal keys"
+                          << std::endl;
+                throw;
+            }
+            previous = value.second;
+        }
+    }
+    order_statistic_tree<int> ranked(input.begin(), input.end(), pool);
+    if (*ranked.select(100) != expected[100]) {
+        std::cout << "parallel construction lost subtree sizes"
+                  << std::endl;
+        throw;
+    }
+    using pooled = rb_tree<int, std::less<int>, pool_allocator<int>>;
+    pool_allocator<int> shared;
+    for (int op = 0; op < 3; ++op) {
+        pooled a(shared), b(shared);
+        rb_tree<int> expected_a, expected_b;
+        for (int i = 0; i < 2000; ++i) {
+            a.insert(i * 2);
+            expected_a.insert(i * 2);
+        }
+        for (int i = 0; i < 1500; ++i) {
+            b.insert(i * 3);
+            expected_b.insert(i * 3);
+        }
+        if (op == 0) {
+            a.set_union(std::move(b), pool);
+            expected_a.set_union(std::move(expected_b));
+        } else if (op == 1) {
+            a.set_intersection(std::move(b), pool);
+            expected_a.set_intersection(std::move(expected_b));
+        } else {
+            a.set_difference(std::move(b), pool);
+            expected_a.set_difference(std::move(expected_b));
+        }
+        check_contents(a, contents(expected_a), "parallel set operation");
+    }
+}
+
+void batch_updates() {
+    rb_tree<int> actual;
+    std::vector<int> reference;
+    for (int i = 0; i < 500; ++i) {
+        actual.insert(i * 4);
+        reference.push_back(i * 4);
+    }
+    std::vector<int> batch;
+    for (int i = 0; i < 3000; ++i) batch.push_back((i * 7919) % 2500 - 100);
+    auto inserted = actual.insert_batch(batch.begin(), batch.end());
+    for (std::size_t i = 0; i < batch.size(); ++i) {
+        bool fresh = std::find(reference.begin(), reference.end(),
+                               batch[i]) == reference.end();
+        if (fresh) reference.push_back(batch[i]);
+        if (inserted[i] != fresh) {
+            std::cout << "insert_batch flag " << i << " is wrong"
+                      << std::endl;
+            throw;
+        }
+    }
+    std::sort(reference.begin(), reference.end());
+    check_contents(actual, reference, "insert_batch");
+    std::vector<int> keys;
+    for (int i = 0; i < 1000; ++i) keys.push_back((i * 31) % 3000 - 200);
+    auto erased = actual.erase_batch(keys.begin(), keys.end());
+    for (std::size_t i = 0; i < keys.size(); ++i) {
+        auto it = std::find(reference.begin(), reference.end(), keys[i]);
+        if (erased[i] != (it != reference.end())) {
+            std::cout << "erase_batch flag " << i << " is wrong"
+                      << std::endl;
+            throw;
+        }
+        if (it != reference.end()) reference.erase(it);
+    }
+    check_contents(actual, reference, "erase_batch");
+    rb_multiset<int> multi;
+    std::vector<int> values{ 5, 1, 5, 3, 5, 1 };
+    auto all = multi.insert_batch(values.begin(), values.end());
+    std::vector<int> drop{ 5, 2, 5 };
+    auto dropped = multi.erase_batch(drop.begin(), drop.end());
+    if (std::count(all.begin(), all.end(), true) != 6 ||
+        dropped != std::vector<bool>{ true, false, false } ||
+        contents(multi) != std::vector<int>{ 1, 1, 3 }) {
+        std::cout << "batches on a multiset are wrong" << std::endl;
+        throw;
+    }
+}
+
+// Returns the black height, checking order and colors on the way.
+template <typename Node>
+int check_immutable(const Node * x, const int * low, const int * high) {
+    if (!x) return 1;
+    if ((low && x->value <= *low) || (high && x->value >= *high)) {
+        std::cout << "immutable tree is unordered at " << x->value
+                  << std::endl;
+        throw;
+    }
+    for (auto child : x->link) {
+        if (x->color == red && child && child->color == red) {
+            std::cout << "red " << x->value << " has a red child"
+                      << std::endl;
+            throw;
+        }
+    }
+    auto left = check_immutable(x->link[0], low, &x->value);
+    auto right = check_immutable(x->link[1], &x->value, high);
+    if (left != right) {
+        std::cout << "black heights differ below " << x->value
+                  << std::endl;
+        throw;
+    }
+    return left + (x->color == black);
+}
+
+void batched_lookups() {
+    rb_multiset<int> tree;
+    for (int i = 0; i < 3000; ++i) tree.insert((i * 7919) % 1000 * 2);
+    std::vector<int> keys;
+    for (int i = 0; i < 1000; ++i) keys.push_back((i * 31) % 2100 - 50);
+    std::vector<bool> found;
+    tree.contains_batch(keys.begin(), keys.end(), std::back_inserter(found));
+    std::vector<rb_multiset<int>::const_iterator> positions;
+    tree.find_batch(keys.begin(), keys.end(),
+                    std::back_inserter(positions));
+    for (std::size_t i = 0; i < keys.size(); ++i) {
+        if (found[i] != tree.contains(keys[i]) ||
+            positions[i] != tree.find(keys[i])) {
+            std::cout << "batched lookup of " << keys[i] << " is wrong"
+                      << std::endl;
+            throw;
+        }
+    }
+    rb_tree<int> empty;
+    found.clear();
+    empty.contains_batch(keys.begin(), keys.end(), std::back_inserter(found));
+    if (std::count(found.begin(), found.end(), true) != 0) {
+        std::cout << "batched lookup in an empty tree is wrong" << std::endl;
+        throw;
+    }
+}
+
+void concurrent_readers() {
+    concurrent_rb_tree<int> tree;
+    std::vector<int> reference;
+    for (int i = 0; i < 4000; ++i) {
+        int k = (i * 7919) % 701;
+        auto it = std::lower_bound(reference.begin(), reference.end(), k);
+        bool present = it != reference.end() && *it == k;
+        if (i % 3 == 2) {
+            if (tree.erase(k) != present) {
+                std::cout << "erase of " << k << " is wrong" << std::endl;
+                throw;
+            }
+            if (present) reference.erase(it);
+        } else {
+            if (tree.insert(k) == present) {
+                std::cout << "insert of " << k << " is wrong" << std::endl;
+                throw;
+            }
+            if (!present) reference.insert(it, k);
+        }
+        auto view = tree.read();
+        if (view.get_root() && view.get_root()->color != black) {
+            std::cout << "root of immutable tree is red" << std::endl;
+            throw;
+        }
+        check_immutable(view.get_root(), nullptr, nullptr);
+        if (!std::equal(view.begin(), view.end(),
+                        reference.begin(), reference.end()) ||
+            tree.size() != reference.size()) {
+            std::cout << "concurrent tree differs after " << i
+                      << " updates" << std::endl;
+            throw;
+        }
+    }
+    {
+        // a view keeps seeing the version it pinned
+        auto view = tree.read();
+        for (int k = 0; k < 701; ++k) {
+            tree.erase(k);
+            tree.insert(k + 1000);
+        }
+        if (!std::equal(view.begin(), view.end(),
+                        reference.begin(), reference.end())) {
+            std::cout << "pinned view changed" << std::endl;
+            throw;
+        }
+    }
+    // even keys stay put while the writer churns through odd ones
+    concurrent_rb_tree<int> shared;
+    for (int k = 0; k < 2000; k += 2) shared.insert(k);
+    std::atomic<bool> done{ false };
+    std::atomic<int> failures{ 0 };
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 3; ++t) {
+        readers.emplace_back([&] {
+            do {
+                auto view = shared.read();
+                int previous = -1, evens = 0;
+                for (auto k : view) {
+                    if (k <= previous) ++failures;
+                    if (k % 2 == 0) ++evens;
+                    previous = k;
+                }
+                if (evens != 1000 || !shared.contains(1000)) ++failures;
+            } while (!done.load());
+        });
+    }
+    for (int i = 0; i < 20000; ++i) {
+        int k = (i * 7919) % 2000 | 1;
+        if (i % 2) {
+            shared.erase(k);
+        } else {
+            shared.insert(k);
+        }
+    }
+    done = true;
+    for (auto & reader : readers) reader.join();
+    if (failures != 0) {
+        std::cout << "readers saw a broken tree" << std::endl;
+        throw;
+    }
+}
+
+void persistent_versions() {
+    using allocator = counting_allocator<int>;
+    using tree = persistent_rb_tree<int, std::less<int>, allocator>;
+    std::vector<tree> versions(1);
+    std::vector<std::vector<int>> expected(1);
+    for (int i = 0; i < 1500; ++i) {
+        int k = (i * 7919) % 613;
+        auto version = versions.back();
+        auto values = expected.back();
+        auto it = std::lower_bound(values.begin(), values.end(), k);
+        bool present = it != values.end() && *it == k;
+        auto allocations = allocator::allocations;
+        if (i % 3 == 2) {
+            if (version.erase(k) != present) {
+                std::cout << "persistent erase of " << k << " is wrong"
+                          << std::endl;
+                throw;
+            }
+            if (present) values.erase(it);
+        } else {
+            if (version.insert(k) == present) {
+                std::cout << "persistent insert of " << k << " is wrong"
+                          << std::endl;
+                throw;
+            }
+            if (!present) values.insert(it, k);
+        }
+        // path, siblings and the new node of a tree of height <= 20
+        if (allocator::allocations - allocations > 3 * 20) {
+            std::cout << "update copied " << allocator::allocations -
+                         allocations << " nodes" << std::endl;
+            throw;
+        }
+        versions.push_back(std::move(version));
+        expected.push_back(std::move(values));
+        // drop some versions to exercise reclamation of shared nodes
+        if (i % 5 == 4) {
+            versions.erase(versions.end() - 3);
+            expected.erase(expected.end() - 3);
+        }
+    }
+    for (std::size_t v = 0; v < versions.size(); ++v) {
+        auto & version = versions[v];
+        check_immutable(version.get_root(), nullptr, nullptr);
+        if (!std::equal(version.begin(), version.end(),
+                        expected[v].begin(), expected[v].end()) ||
+            version.size() != expected[v].size() ||
+            (version.get_root() && version.get_root()->color != black)) {
+            std::cout << "version " << v << " is wrong" << std::endl;
+            throw;
+        }
+        for (int k = -1; k <= 613; ++k) {
+            if (version.contains(k) != std::binary_search(
+                    expected[v].begin(), expected[v].end(), k)) {
+                std::cout << "version " << v << " misses " << k << std::endl;
+                throw;
+            }
+        }
+    }
+    persistent_rb_tree<std::string> strings;
+    for (int i = 0; i < 100; ++i) strings.insert(std::to_string(i));
+    auto snapshot = strings;
+    for (int i = 0; i < 100; i += 2) strings.erase(std::to_string(i));
+    strings = snapshot;
+    if (strings.size() != 100 || !strings.contains("42")) {
+        std::cout << "assigned version is wrong" << std::endl;
+        throw;
+    }
+    // a snapshot read and dropped by another thread while this one writes
+    std::size_t seen = 0;
+    std::thread reader([&seen, old = std::move(snapshot)] {
+        for (auto & value : old) seen += value.size();
+    });
+    for (int i = 0; i < 100; ++i) strings.erase(std::to_string(i));
+    reader.join();
+    if (seen != 190 || !strings.empty()) {
+        std::cout << "snapshot read by another thread is wrong" << std::endl;
+        throw;
+    }
+}
+
+void sharded_writers() {
+    std::vector<int> sample;
+    for (int i = 0; i < 4000; i += 7) sample.push_back(i);
+    sharded_rb_tree<int> actual(sample.begin(), sample.end(), 8);
+    if (actual.shard_count() != 8) {
+        std::cout << "sharded tree has " << actual.shard_count()
+                  << " shards" << std::endl;
+        throw;
+    }
+    // every thread inserts its residue class and erases a third of it,
+    // with keys below and above the sample falling in the outer shards
+    std::vector<std::thread> writers;
+    for (int t = 0; t < 4; ++t) {
+        writers.emplace_back([&actual, t] {
+            for (int k = t - 100; k < 4100; k += 4) actual.insert(k);
+            for (int k = t - 100; k < 4100; k += 12) actual.erase(k);
+            for (int k = t - 100; k < 4100; k += 12) {
+                if (actual.erase(k)) throw std::logic_error("erased twice");
+            }
+        });
+    }
+    for (auto & writer : writers) writer.join();
+    std::vector<int> expected;
+    for (int k = -100; k < 4100; ++k) {
+        if ((k + 100) % 12 >= 4) expected.push_back(k);
+    }
+    std::vector<int> values;
+    actual.for_each([&](int value) { values.push_back(value); });
+    if (values != expected || actual.size() != expected.size() ||
+        actual.contains(-100) || !actual.contains(4099)) {
+        std::cout << "sharded tree is wrong" << std::endl;
+        throw;
+    }
+    // ranges within a shard, across several and beyond the splitters
+    for (auto range : { std::make_pair(10, 20), std::make_pair(-150, 700),
+                        std::make_pair(500, 3000), std::make_pair(3990, 5000),
+                        std::make_pair(30, 30), std::make_pair(40, 30) }) {
+        values.clear();
+        actual.for_each(range.first, range.second,
+                        [&](int value) { values.push_back(value); });
+        std::vector<int> in_range;
+        for (auto k : expected) {
+            if (range.first <= k && k < range.second) in_range.push_back(k);
+        }
+        if (values != in_range) {
+            std::cout << "sharded range [" << range.first << ", "
+                      << range.second << ") is wrong" << std::endl;
+            throw;
+        }
+    }
+    sharded_rb_tree<int, std::greater<int>> descending({ 10, 0, 10, 5 });
+    for (int k = -3; k < 14; ++k) descending.insert(k);
+    values.clear();
+    descending.for_each([&](int value) { values.push_back(value); });
+    std::vector<int> range;
+    descending.for_each(12, 2, [&](int value) { range.push_back(value); });
+    if (descending.shard_count() != 4 || values.size() != 17 ||
+        !std::is_sorted(values.begin(), values.end(), std::greater<int>()) ||
+        range != std::vector<int>{ 12, 11, 10, 9, 8, 7, 6, 5, 4, 3 }) {
+        std::cout << "sharded tree with custom order is wrong" << std::endl;
+        throw;
+    }
+}
+
+void compact_nodes() {
+    if (compact_rb_tree<int>::node_size > 16) {
+        std::cout << "compact node of int takes "
+                  << compact_rb_tree<int>::node_size << " bytes" << std::endl;
+        throw;
+    }
+    compact_rb_tree<int> actual;
+    std::vector<int> reference;
+    for (int i = 0; i < 6000; ++i) {
+        int k = (i * 7919) % 2111;
+        auto it = std::lower_bound(reference.begin(), reference.end(), k);
+        bool present = it != reference.end() && *it == k;
+        if (i % 3 == 2) {
+            if (actual.erase(k) != (present ? 1u : 0u)) {
+                std::cout << "compact erase of " << k << " is wrong"
+                          << std::endl;
+                throw;
+            }
+            if (present) reference.erase(it);
+        } else {
+            auto inserted = actual.insert(k);
+            if ((inserted == actual.end()) != present ||
+                (!present && *inserted != k)) {
+                std::cout << "compact insert of " << k << " is wrong"
+                          << std::endl;
+                throw;
+            }
+            if (!present) reference.insert(it, k);
+        }
+    }
+    if (!std::equal(actual.begin(), actual.end(),
+                    reference.begin(), reference.end()) ||
+        !std::equal(std::make_reverse_iterator(actual.end()),
+                    std::make_reverse_iterator(actual.begin()),
+                    reference.rbegin(), reference.rend()) ||
+        actual.size() != reference.size()) {
+        std::cout << "compact tree differs" << std::endl;
+        throw;
+    }
+    // erasing through iterators walks on to the next value
+    for (auto it = actual.find(reference[10]); it != actual.end();) {
+        it = *it % 2 ? actual.erase(it) : std::next(it);
+    }
+    reference.erase(std::remove_if(reference.begin() + 10, reference.end(),
+                                   [](int k) { return k % 2; }),
+                    reference.end());
+    if (!std::equal(actual.begin(), actual.end(),
+                    reference.begin(), reference.end())) {
+        std::cout << "compact erase through iterators is wrong"
+                  << std::endl;
+        throw;
+    }
+    compact_rb_tree<std::string> strings;
+    for (int round = 0; round < 2; ++round) {
+        for (int i = 0; i < 3000; ++i) strings.insert(std::to_string(i));
+        auto moved = std::move(strings);
+        if (moved.size() != 3000 || !moved.contains("2999") ||
+            !strings.empty()) {
+            std::cout << "compact tree of strings is wrong" << std::endl;
+            throw;
+        }
+        moved.clear();
+        moved.insert("reused");
+        if (*moved.begin() != "reused") {
+            std::cout << "cleared compact tree is wrong" << std::endl;
+            throw;
+        }
+    }
+}
+
+template <bool Prefetch>
+void check_frozen(const rb_tree<int> & tree, const std::vector<int> & values) {
+    auto frozen = freeze<Prefetch>(tree);
+    if (frozen.size() != values.size() ||
+        !std::equal(frozen.begin(), frozen.end(),
+                    values.begin(), values.end())) {
+        std::cout << "frozen set of " << values.size() << " is wrong"
+                  << std::endl;
+        throw;
+    }
+    for (int k = -1; k <= static_cast<int>(values.size()) * 3; ++k) {
+        auto lower = std::lower_bound(values.begin(), values.end(), k);
+        auto upper = std::upper_bound(values.begin(), values.end(), k);
+        auto frozen_lower = frozen.lower_bound(k);
+        auto frozen_upper = frozen.upper_bound(k);
+        if ((lower == values.end()) != (frozen_lower == frozen.end()) ||
+            (lower != values.end() && *lower != *frozen_lower) ||
+            (upper == values.end()) != (frozen_upper == frozen.end()) ||
+            (upper != values.end() && *upper != *frozen_upper) ||
+            frozen.contains(k) != (k % 3 == 0 && lower != values.end()) ||
+            (frozen.find(k) != frozen.end()) != frozen.contains(k)) {
+            std::cout << "frozen lookup of " << k << " in "
+                      << values.size() << " values is wrong" << std::endl;
+            throw;
+        }
+    }
+    check_contents(frozen.thaw(), values, "thawed tree");
+}
+
+void frozen_sets() {
+    for (int n = 0; n < 70; ++n) {
+        std::vector<int> values;
+        for (int i = 0; i < n; ++i) values.push_back(3 * i);
+        rb_tree<int> tree(values.begin(), values.end());
+        check_frozen<true>(tree, values);
+        check_frozen<false>(tree, values);
+    }
+    std::vector<int> values;
+    for (int i = 0; i < 5000; ++i) values.push_back(3 * i);
+    check_frozen<true>(rb_tree<int>(values.begin(), values.end()), values);
+    rb_multiset<int> multi;
+    for (int k : { 4, 1, 4, 2, 4, 1 }) multi.insert(k);
+    auto frozen = freeze(multi);
+    if (*frozen.lower_bound(4) != 4 || *frozen.upper_bound(1) != 2 ||
+        frozen.upper_bound(4) != frozen.end() ||
+        contents(frozen.thaw<rb_multiset<int>>()) !=
+            std::vector<int>{ 1, 1, 2, 4, 4, 4 }) {
+        std::cout << "frozen multiset is wrong" << std::endl;
+        throw;
+    }
+    rb_tree<int, std::greater<int>> descending;
+    for (int k = 0; k < 10; ++k) descending.insert(k);
+    auto frozen_descending = freeze(descending);
+    if (*frozen_descending.begin() != 9 ||
+        *frozen_descending.lower_bound(20) != 9 ||
+        frozen_descending.lower_bound(-1) != frozen_descending.end()) {
+        std::cout << "frozen set with custom order is wrong" << std::endl;
+        throw;
+    }
+}
+
+template <typename Key>
+void check_blocked(std::size_t n) {
+    // spread over the whole range, extremes included
+    using U = std::make_unsigned_t<Key>;
+    std::vector<Key> values;
+    auto low = std::numeric_limits<Key>::min();
+    auto high = std::numeric_limits<Key>::max();
+    auto step = static_cast<U>(U(-1) / (n + 1));
+    for (std::size_t i = 0; i < n; ++i) {
+        values.push_back(static_cast<Key>(static_cast<U>(low) + step * i));
+    }
+    if (n > 2) values.back() = high;
+    rb_tree<Key> tree(values.begin(), values.end(), sorted_tag());
+    auto blocked = freeze_blocked(tree);
+    std::vector<Key> queries{ low, high, Key(0), Key(1) };
+    for (auto value : values) {
+        queries.push_back(value);
+        queries.push_back(static_cast<Key>(static_cast<U>(value) + 1));
+        queries.push_back(static_cast<Key>(static_cast<U>(value) - 1));
+    }
+    for (auto level : { simd_level::avx2, simd_level::sse42,
+                        simd_level::scalar }) {
+        blocked.limit_simd(level);
+        std::vector<bool> found;
+        blocked.contains_batch(queries.begin(), queries.end(),
+                               std::back_inserter(found));
+        for (std::size_t i = 0; i < queries.size(); ++i) {
+            bool expected = std::binary_search(values.begin(), values.end(),
+                                               queries[i]);
+            if (blocked.contains(queries[i]) != expected ||
+                found[i] != expected) {
+                std::cout << "blocked set of " << n << " keys is wrong for "
+                          << queries[i] << " at level "
+                          << static_cast<int>(blocked.simd()) << std::endl;
+                throw;
+            }
+        }
+    }
+}
+
+void blocked_sets() {
+    for (std::size_t n : { 0, 1, 2, 15, 16, 17, 100, 272, 289, 5000 }) {
+        check_blocked<int>(n);
+        check_blocked<unsigned>(n);
+        check_blocked<std::int64_t>(n);
+        check_blocked<std::uint64_t>(n);
+    }
+}
+
 void test() {
     insert_1_seq();
     insert_2_seq();
@@ -392,4 +1946,41 @@ void test() {
     insert_11_seq();
     insert_12_seq();
     insert_13_seq();
+    pool_allocator_reuses_freed_slots();
+    pool_allocator_many_chunks();
+    pool_allocator_tree();
+    custom_compare();
+    transparent_lookup();
+    map_operations();
+    multiset_keeps_duplicates();
+    multimap_keeps_insertion_order();
+    duplicate_insert_does_not_allocate();
+    move_only_values();
+    extract_moves_nodes_between_trees();
+    sorted_build();
+    hinted_insert();
+    copy_preserves_shape();
+    copy_with_pool();
+    size_is_tracked();
+    order_statistics();
+    custom_augmentation();
+    pooled_augmentation();
+    interval_overlaps();
+    range_queries();
+    erase_ranges();
+    clear_and_reuse();
+    value_iterators();
+    linked_trees();
+    tree_stats();
+    join_and_split();
+    set_algebra();
+    parallel_operations();
+    batch_updates();
+    batched_lookups();
+    concurrent_readers();
+    persistent_versions();
+    sharded_writers();
+    compact_nodes();
+    frozen_sets();
+    blocked_sets();
 }
@@ -0,0 +1,206 @@
+#ifndef WORK_STEALING_POOL_HPP
+#define WORK_STEALING_POOL_HPP
+
+#include "executor.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fork-join executor over a fixed set of std::threads. Every worker owns
+// a deque: forks push onto its back and are popped back LIFO, while idle
+// workers steal from the front of the others, which takes the oldest and
+// hence largest pieces of work. A thread waiting for a stolen fork runs
+// other tasks meanwhile, so nested fork_join never blocks a worker.
+// Threads outside the pool share one extra deque.
+class work_stealing_pool {
+    struct task {
+        std::atomic<bool> done{ false };
+        std::exception_ptr error;
+
+        virtual void run() = 0;
+
+        void execute() {
+            try {
+                run();
+            } catch (...) {
+                error = std::current_exception();
+            }
+            done.store(true, std::memory_order_release);
+        }
+
+    protected:
+        ~task() = default;
+    };
+
+    template <typename F>
+    struct function_task : task {
+        F & f;
+
+        explicit function_task(F & f) : f(f) { }
+
+        void run() override {
+            f();
+        }
+    };
+
+    struct task_queue {
+        std::mutex mutex;
+        std::deque<task *> tasks;
+    };
+
+    std::size_t grain;
+    std::vector<std::unique_ptr<task_queue>> queues;
+    std::vector<std::thread> workers;
+    std::atomic<std::size_t> pending{ 0 };
+    std::atomic<bool> stopping{ false };
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+
+    static inline thread_local const work_stealing_pool * current = nullptr;
+    static inline thread_local std::size_t current_index = 0;
+
+    // Deque of the calling thread: its own for workers, the shared one
+    // for everybody else.
+    std::size_t own_queue() const {
+        return current == this ? current_index : workers.size();
+    }
+
+    void push(task * t) {
+        auto & queue = *queues[own_queue()];
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back(t);
+        }
+        {
+            // pairs with the predicate check of sleeping workers
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            pending.fetch_add(1, std::memory_order_relaxed);
+        }
+        wake.notify_one();
+    }
+
+    // Takes t back if nobody has stolen it yet.
+    bool take_back(task * t) {
+        auto & queue = *queues[own_queue()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty() || queue.tasks.back() != t) return false;
+        queue.tasks.pop_back();
+        pending.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Runs one task: the newest of the caller's own, or else the oldest
+    // of someone else's. Returns false if there was none.
+    bool run_one() {
+        auto self = own_queue();
+        task * t = nullptr;
+        for (std::size_t i = 0; i < queues.size() && !t; ++i) {
+            auto & queue = *queues[(self + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tasks.empty()) continue;
+            if (i == 0) {
+                t = queue.tasks.back();
+                queue.tasks.pop_back();
+            } else {
+                t = queue.tasks.front();
+                queue.tasks.pop_front();
+            }
+        }
+        if (!t) return false;
+        pending.fetch_sub(1, std::memory_order_relaxed);
+        t->execute();
+        return true;
+    }
+
+    void work(std::size_t index) {
+        current = this;
+        current_index = index;
+        while (!stopping.load(std::memory_order_acquire)) {
+            if (run_one()) continue;
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            wake.wait(lock, [&] {
+                return stopping.load(std::memory_order_relaxed) ||
+                       pending.load(std::memory_order_relaxed) != 0;
+            });
+        }
+    }
+
+public:
+
+    // threads counts the caller, which works while it waits, so a pool
+    // of one thread starts no workers at all and runs everything inline.
+    explicit work_stealing_pool(
+            unsigned threads = std::thread::hardware_concurrency(),
+            std::size_t grain = 4096)
+            : grain(grain) {
+        if (threads == 0) threads = 1;
+        for (unsigned i = 0; i < threads; ++i) {
+            queues.push_back(std::make_unique<task_queue>());
+        }
+        workers.reserve(threads - 1);
+        for (unsigned i = 0; i + 1 < threads; ++i) {
+            workers.emplace_back([this, i] { work(i); });
+        }
+    }
+
+    work_stealing_pool(const work_stealing_pool &) = delete;
+
+    work_stealing_pool & operator=(const work_stealing_pool &) = delete;
+
+    ~work_stealing_pool() {
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            stopping.store(true, std::memory_order_release);
+        }
+        wake.notify_all();
+        for (auto & worker : workers) worker.join();
+    }
+
+    // Offers g to other threads, runs f, then runs g as well unless it was
+    // stolen, in which case the caller helps out until g is done. The
+    // first exception thrown by either is rethrown.
+    template <typename F, typename G>
+    void fork_join(F && f, G && g) {
+        if (workers.empty()) {
+            f();
+            g();
+            return;
+        }
+        function_task<G> forked(g);
+        push(&forked);
+        std::exception_ptr error;
+        try {
+            f();
+        } catch (...) {
+            error = std::current_exception();
+        }
+        if (take_back(&forked)) {
+            forked.execute();
+        } else {
+            while (!forked.done.load(std::memory_order_acquire)) {
+                if (!run_one()) std::this_thread::yield();
+            }
+        }
+        if (error) std::rethrow_exception(error);
+        if (forked.error) std::rethrow_exception(forked.error);
+    }
+
+    std::size_t grain_size() const {
+        return grain;
+    }
+
+    // Number of threads running tasks, including the caller.
+    unsigned concurrency() const {
+        return static_cast<unsigned>(workers.size() + 1);
+    }
+
+};
+
+#endif